@@ -452,6 +452,9 @@ static struct kmem_cache *vm_area_cachep;
 /* SLAB cache for mm_struct structures (tsk->mm) */
 static struct kmem_cache *mm_cachep;
 
+/* SLAB cache for kv_node structures (signal->kv_store) */
+struct kmem_cache *kv_node_cachep;
+
 struct vm_area_struct *vm_area_alloc(struct mm_struct *mm)
 {
 	struct vm_area_struct *vma;
@@ -821,6 +824,7 @@ static inline void free_signal_struct(struct signal_struct *sig)
 	 */
 	if (sig->oom_mm)
 		mmdrop_async(sig->oom_mm);
+	put_kv_store(sig->kv_store);
 	kmem_cache_free(signal_cachep, sig);
 }
 
@@ -830,29 +834,12 @@ static inline void put_signal_struct(struct signal_struct *sig)
 		free_signal_struct(sig);
 }
 
-static void free_kv_store(struct task_struct *tsk) {
-	struct kv_node *entry;
-    struct hlist_node *n;
-    for (int i = 0; i < 1024; i++) {
-        struct kv_bucket *bucket = tsk->kv_store[i];
-        spin_lock(&bucket->lock);
-        hlist_for_each_entry_safe(entry, n, &bucket->head, node) {
-            hlist_del(&entry->node);
-            kfree(entry);
-        }
-        spin_unlock(&bucket->lock);
-    }
-}
-
 void __put_task_struct(struct task_struct *tsk)
 {
 	WARN_ON(!tsk->exit_state);
 	WARN_ON(refcount_read(&tsk->usage));
 	WARN_ON(tsk == current);
 
-	if (tsk->pid == tsk->tgid)
-		free_kv_store(tsk);
-
 	io_uring_free(tsk);
 	cgroup_free(tsk);
 	task_numa_free(tsk, true);
@@ -1648,6 +1635,27 @@ out:
 	return error;
 }
 
+/*
+ * Threads share the group's KV store through signal_struct, and the
+ * first write_kv attaches it lazily. A new process starts without one
+ * unless the parent's store is inherited; free_signal_struct() drops it.
+ */
+static int copy_kv_store(unsigned long clone_flags, struct task_struct *tsk)
+{
+	struct kv_store *store;
+
+	if (clone_flags & CLONE_THREAD)
+		return 0;
+	store = smp_load_acquire(&current->signal->kv_store);
+	if (!store)
+		return 0;
+	store = kv_store_fork(store);
+	if (IS_ERR(store))
+		return PTR_ERR(store);
+	tsk->signal->kv_store = store;
+	return 0;
+}
+
 static int copy_sighand(unsigned long clone_flags, struct task_struct *tsk)
 {
 	struct sighand_struct *sig;
@@ -2264,6 +2272,9 @@ static __latent_entropy struct task_struct *copy_process(
 	retval = copy_io(clone_flags, p);
 	if (retval)
 		goto bad_fork_cleanup_namespaces;
+	retval = copy_kv_store(clone_flags, p);
+	if (retval)
+		goto bad_fork_cleanup_io;
 	retval = copy_thread(p, args);
 	if (retval)
 		goto bad_fork_cleanup_io;
@@ -2492,15 +2503,7 @@ static __latent_entropy struct task_struct *copy_process(
 
 	copy_oom_score_adj(clone_flags, p);
 
-	if(p && p->pid == p->tgid) {
-		for (int i = 0; i < 1024; i++) {
-			p->kv_store[i] = kmalloc(sizeof(struct kv_bucket), GFP_KERNEL);
-			INIT_HLIST_HEAD(&p->kv_store[i]->head);
-			spin_lock_init(&p->kv_store[i]->lock);
-		}
-	} else if(p) {
-		for (int i = 0; i < 1024; i++)
-			p->kv_store[i] = current->group_leader->kv_store[i];
+	if(p && p->pid != p->tgid) {
 		p->socket_count = 0;
 		p->socket_limit = 1024; // default socket limit
 		p->socket_priority = 1; // default socket priority
@@ -3059,6 +3062,7 @@ void __init proc_caches_init(void)
 			sizeof_field(struct mm_struct, saved_auxv),
 			NULL);
 	vm_area_cachep = KMEM_CACHE(vm_area_struct, SLAB_PANIC|SLAB_ACCOUNT);
+	kv_node_cachep = KMEM_CACHE(kv_node, SLAB_PANIC|SLAB_ACCOUNT);
 	mmap_init();
 	nsproxy_cache_init();
 }
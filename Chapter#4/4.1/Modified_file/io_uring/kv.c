@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/file.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+#include <linux/io_uring.h>
+
+#include <uapi/linux/io_uring.h>
+
+#include "io_uring.h"
+#include "kv.h"
+
+struct io_kv {
+	struct file			*file;
+	struct kv_store			*store;
+	int				key;
+	int				val;
+	int __user			*uval;
+};
+
+/*
+ * The store is looked up here, in the submitter's context, and pinned
+ * until the request completes, so an io-wq worker (or the SQPOLL thread)
+ * that issues it works on the submitting process's store.
+ */
+int io_kv_prep(struct io_kiocb *req, const struct io_uring_sqe *sqe)
+{
+	struct io_kv *kv = io_kiocb_to_cmd(req, struct io_kv);
+	bool write = req->opcode == IORING_OP_KV_WRITE;
+
+	if (sqe->ioprio || sqe->buf_index || sqe->rw_flags ||
+	    sqe->splice_fd_in || sqe->addr3 || sqe->__pad2[0])
+		return -EINVAL;
+	if (unlikely(req->flags & REQ_F_FIXED_FILE))
+		return -EBADF;
+
+	kv->key = READ_ONCE(sqe->off);
+	if (write) {
+		if (sqe->addr)
+			return -EINVAL;
+		kv->val = READ_ONCE(sqe->len);
+	} else {
+		if (sqe->len)
+			return -EINVAL;
+		kv->uval = u64_to_user_ptr(READ_ONCE(sqe->addr));
+	}
+
+	kv->store = kv_store_get_current(write);
+	if (!kv->store)
+		return write ? -ENOMEM : -ENOENT;
+	req->flags |= REQ_F_NEED_CLEANUP;
+	return 0;
+}
+
+int io_kv_read(struct io_kiocb *req, unsigned int issue_flags)
+{
+	struct io_kv *kv = io_kiocb_to_cmd(req, struct io_kv);
+	int val, ret;
+
+	ret = kv_store_read(kv->store, kv->key, &val);
+	if (!ret && put_user(val, kv->uval))
+		ret = -EFAULT;
+	io_kv_cleanup(req);
+	req->flags &= ~REQ_F_NEED_CLEANUP;
+	io_req_set_res(req, ret, 0);
+	return IOU_OK;
+}
+
+int io_kv_write(struct io_kiocb *req, unsigned int issue_flags)
+{
+	struct io_kv *kv = io_kiocb_to_cmd(req, struct io_kv);
+	int ret;
+
+	/*
+	 * Most writes update a key in place and complete inline; one that
+	 * has to allocate or copy a bucket goes to io-wq.
+	 */
+	if (issue_flags & IO_URING_F_NONBLOCK) {
+		ret = kv_store_try_write(kv->store, kv->key, kv->val);
+		if (ret == -EAGAIN)
+			return -EAGAIN;
+	} else {
+		ret = kv_store_write(kv->store, kv->key, kv->val);
+	}
+	io_kv_cleanup(req);
+	req->flags &= ~REQ_F_NEED_CLEANUP;
+	io_req_set_res(req, ret, 0);
+	return IOU_OK;
+}
+
+void io_kv_cleanup(struct io_kiocb *req)
+{
+	struct io_kv *kv = io_kiocb_to_cmd(req, struct io_kv);
+
+	put_kv_store(kv->store);
+}
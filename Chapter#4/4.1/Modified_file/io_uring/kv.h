@@ -0,0 +1,6 @@
+// SPDX-License-Identifier: GPL-2.0
+
+int io_kv_prep(struct io_kiocb *req, const struct io_uring_sqe *sqe);
+int io_kv_read(struct io_kiocb *req, unsigned int issue_flags);
+int io_kv_write(struct io_kiocb *req, unsigned int issue_flags);
+void io_kv_cleanup(struct io_kiocb *req);
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kv
+
+#if !defined(_TRACE_KV_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_KV_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * write_kv/read_kv: the key, its bucket (home group in the flat layout),
+ * how many nodes (groups) were walked and whether the key was found. For
+ * kv_write, hit means the key was already there.
+ */
+DECLARE_EVENT_CLASS(kv_access,
+
+	TP_PROTO(int key, int bucket, unsigned int chain, bool hit),
+
+	TP_ARGS(key, bucket, chain, hit),
+
+	TP_STRUCT__entry(
+		__field(int,		key)
+		__field(int,		bucket)
+		__field(unsigned int,	chain)
+		__field(bool,		hit)
+	),
+
+	TP_fast_assign(
+		__entry->key	= key;
+		__entry->bucket	= bucket;
+		__entry->chain	= chain;
+		__entry->hit	= hit;
+	),
+
+	TP_printk("key=%d bucket=%d chain=%u %s", __entry->key,
+		  __entry->bucket, __entry->chain,
+		  __entry->hit ? "hit" : "miss")
+);
+
+DEFINE_EVENT(kv_access, kv_read,
+
+	TP_PROTO(int key, int bucket, unsigned int chain, bool hit),
+
+	TP_ARGS(key, bucket, chain, hit)
+);
+
+DEFINE_EVENT(kv_access, kv_write,
+
+	TP_PROTO(int key, int bucket, unsigned int chain, bool hit),
+
+	TP_ARGS(key, bucket, chain, hit)
+);
+
+#endif /* _TRACE_KV_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -0,0 +1,1424 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYS_write_kv 451
+#define SYS_read_kv 452
+#define SYS_write_kv_batch 454
+#define SYS_read_kv_batch 455
+#define SYS_kv_ctl 456
+#define SYS_kv_scan 459
+#define SYS_write_kv_ttl 460
+#define SYS_kv_wait 461
+#define SYS_kv_attach 462
+#define SYS_kv_ns_write 463
+#define SYS_kv_ns_read 464
+#define SYS_kv_dump 465
+#define SYS_kv_load 466
+#define SYS_kv_range 467
+#define SYS_write_kv_blob 468
+#define SYS_read_kv_blob 469
+#define SYS_kv_snapshot 470
+#define SYS_kv_watch 471
+
+#define KV_CTL_SET_LAYOUT 1
+#define KV_CTL_MAP_SHARED 3
+#define KV_CTL_SET_LIMIT 4
+#define KV_CTL_SET_EVICT 5
+#define KV_CTL_SET_INHERIT 6
+#define KV_CTL_SET_NODE 7
+#define KV_CTL_SET_REPLICAS 8
+#define KV_LAYOUT_HASH 0
+#define KV_LAYOUT_FLAT 1
+#define KV_LAYOUT_ORDERED 2
+
+#define MAX_BATCH 4096
+
+static long write_kv(int k, int v) { return syscall(SYS_write_kv, k, v); }
+
+static long read_kv(int k) { return syscall(SYS_read_kv, k); }
+
+static long write_kv_batch(const int *keys, const int *vals, unsigned int n) {
+  return syscall(SYS_write_kv_batch, keys, vals, n);
+}
+
+static long read_kv_batch(const int *keys, int *vals, unsigned int n) {
+  return syscall(SYS_read_kv_batch, keys, vals, n);
+}
+
+static long kv_ctl(int op, unsigned long arg) {
+  return syscall(SYS_kv_ctl, op, arg);
+}
+
+// Layout of the read-only mirror returned by KV_CTL_MAP_SHARED
+struct kv_shared_hdr {
+  uint32_t seq;
+  uint32_t nslots;
+  uint32_t used;
+  uint32_t overflow;
+};
+
+struct kv_shared_slot {
+  uint32_t state; // 0 empty, 1 full, 2 removed
+  int key;
+  int value;
+};
+
+// read_kv without a syscall: probe the mirror under its sequence counter
+// and only ask the kernel when a miss cannot be trusted.
+static int kv_shared_read(const struct kv_shared_hdr *hdr, int k) {
+  const struct kv_shared_slot *slots = (const void *)(hdr + 1);
+  uint32_t mask = hdr->nslots - 1;
+  int shift = 32 - __builtin_ctz(hdr->nslots);
+  uint32_t seq;
+  int value, found;
+
+  do {
+    while ((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+      ;
+    found = 0;
+    value = -1;
+    for (uint32_t i = ((uint32_t)k * 0x9e3779b1U) >> shift, n = 0;
+         n < hdr->nslots; n++, i = (i + 1) & mask) {
+      uint32_t state = __atomic_load_n(&slots[i].state, __ATOMIC_RELAXED);
+      if (state == 0)
+        break;
+      if (slots[i].key == k) {
+        found = 1;
+        if (state == 1)
+          value = slots[i].value;
+        break;
+      }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq);
+
+  if (!found && hdr->overflow)
+    return read_kv(k);
+  return value;
+}
+
+static long kv_scan(unsigned long *cursor, int *keys, int *vals,
+                    unsigned int max) {
+  return syscall(SYS_kv_scan, cursor, keys, vals, max);
+}
+
+static long write_kv_ttl(int k, int v, unsigned int ms) {
+  return syscall(SYS_write_kv_ttl, k, v, ms);
+}
+
+static long kv_wait(int k, int expected, unsigned int timeout_ms) {
+  return syscall(SYS_kv_wait, k, expected, timeout_ms);
+}
+
+static long kv_attach(const char *name, int flags, mode_t mode) {
+  return syscall(SYS_kv_attach, name, flags, mode);
+}
+
+static long kv_ns_write(int fd, int k, int v) {
+  return syscall(SYS_kv_ns_write, fd, k, v);
+}
+
+static long kv_ns_read(int fd, int k, int *v) {
+  return syscall(SYS_kv_ns_read, fd, k, v);
+}
+
+static long kv_dump(int fd) { return syscall(SYS_kv_dump, fd); }
+
+static long kv_load(int fd) { return syscall(SYS_kv_load, fd); }
+
+static long kv_range(long lo, long hi, int *keys, int *vals, unsigned int max) {
+  return syscall(SYS_kv_range, lo, hi, keys, vals, max);
+}
+
+static long write_kv_blob(uint64_t k, const void *buf, unsigned int len) {
+  return syscall(SYS_write_kv_blob, k, buf, len);
+}
+
+static long read_kv_blob(uint64_t k, void *buf, unsigned int len) {
+  return syscall(SYS_read_kv_blob, k, buf, len);
+}
+
+static long kv_snapshot(int flags) { return syscall(SYS_kv_snapshot, flags); }
+
+static long kv_watch(int k, int efd) { return syscall(SYS_kv_watch, k, efd); }
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compare one syscall per key against the batched syscalls, for batch
+// sizes 1, 2, 4, ..., 4096. Every run touches `total` keys.
+void bench_batch(int total) {
+  static int keys[MAX_BATCH], vals[MAX_BATCH];
+  double t0, t_single_w, t_single_r;
+
+  printf("\n=== Single vs batched KV syscalls (%d keys) ===\n", total);
+
+  t0 = now_sec();
+  for (int i = 0; i < total; i++)
+    write_kv(i, i);
+  t_single_w = now_sec() - t0;
+
+  t0 = now_sec();
+  for (int i = 0; i < total; i++)
+    if (read_kv(i) != i) {
+      fprintf(stderr, "read_kv(%d) mismatch\n", i);
+      exit(1);
+    }
+  t_single_r = now_sec() - t0;
+
+  printf("%-8s %14s %14s\n", "batch", "write Mops/s", "read Mops/s");
+  printf("%-8s %14.3f %14.3f\n", "single", total / t_single_w / 1e6,
+         total / t_single_r / 1e6);
+
+  for (int batch = 1; batch <= MAX_BATCH; batch *= 2) {
+    double t_w, t_r;
+
+    t0 = now_sec();
+    for (int base = 0; base < total; base += batch) {
+      int n = total - base < batch ? total - base : batch;
+      for (int i = 0; i < n; i++) {
+        keys[i] = base + i;
+        vals[i] = base + i + 1;
+      }
+      if (write_kv_batch(keys, vals, n) != n) {
+        perror("write_kv_batch");
+        exit(1);
+      }
+    }
+    t_w = now_sec() - t0;
+
+    t0 = now_sec();
+    for (int base = 0; base < total; base += batch) {
+      int n = total - base < batch ? total - base : batch;
+      for (int i = 0; i < n; i++)
+        keys[i] = base + i;
+      if (read_kv_batch(keys, vals, n) != n) {
+        perror("read_kv_batch");
+        exit(1);
+      }
+      for (int i = 0; i < n; i++)
+        if (vals[i] != keys[i] + 1) {
+          fprintf(stderr, "read_kv_batch(%d) mismatch\n", keys[i]);
+          exit(1);
+        }
+    }
+    t_r = now_sec() - t0;
+
+    printf("%-8d %14.3f %14.3f\n", batch, total / t_w / 1e6,
+           total / t_r / 1e6);
+  }
+}
+
+struct reader_arg {
+  int keys;
+  double seconds;
+  unsigned int seed;
+  long ops;
+};
+
+static volatile int start_flag;
+
+void *reader_thread(void *p) {
+  struct reader_arg *arg = p;
+  unsigned int seed = arg->seed;
+  long ops = 0;
+  double end;
+
+  while (!start_flag)
+    ;
+  end = now_sec() + arg->seconds;
+  while (now_sec() < end) {
+    // Check the clock every 1024 reads to keep it out of the loop cost
+    for (int i = 0; i < 1024; i++)
+      read_kv(rand_r(&seed) % arg->keys);
+    ops += 1024;
+  }
+  arg->ops = ops;
+  return NULL;
+}
+
+// Read-only throughput with 1, 2, 4, ... up to max_threads threads of one
+// process, all sharing the same store. With the RCU read path the
+// aggregate rate should grow linearly with the thread count.
+void bench_readscale(int keys, int max_threads, double seconds) {
+  double base = 0;
+
+  printf("\n=== Read scaling (%d keys, %.1fs per run) ===\n", keys, seconds);
+  for (int i = 0; i < keys; i++)
+    write_kv(i, i);
+
+  printf("%-8s %14s %10s\n", "threads", "read Mops/s", "speedup");
+  for (int n = 1; n <= max_threads; n *= 2) {
+    pthread_t tids[n];
+    struct reader_arg args[n];
+    long total = 0;
+    double mops;
+
+    start_flag = 0;
+    for (int i = 0; i < n; i++) {
+      args[i] = (struct reader_arg){keys, seconds, i + 1, 0};
+      pthread_create(&tids[i], NULL, reader_thread, &args[i]);
+    }
+    start_flag = 1;
+    for (int i = 0; i < n; i++) {
+      pthread_join(tids[i], NULL);
+      total += args[i].ops;
+    }
+    mops = total / seconds / 1e6;
+    if (n == 1)
+      base = mops;
+    printf("%-8d %14.3f %10.2f\n", n, mops, mops / base);
+  }
+}
+
+// fork+_exit+waitpid and fork+exec(/bin/true)+waitpid rates. Run it on
+// kernels before and after a change to compare per-process KV setup cost.
+void bench_fork(int iters) {
+  double t0, t_fork, t_exec;
+
+  printf("\n=== Fork rate (%d iterations) ===\n", iters);
+
+  t0 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    pid_t pid = fork();
+    if (pid == 0)
+      _exit(0);
+    waitpid(pid, NULL, 0);
+  }
+  t_fork = now_sec() - t0;
+
+  t0 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      execl("/bin/true", "true", (char *)NULL);
+      _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+  }
+  t_exec = now_sec() - t0;
+
+  printf("%-12s %12s %12s\n", "mode", "forks/s", "us/fork");
+  printf("%-12s %12.0f %12.2f\n", "fork+exit", iters / t_fork,
+         t_fork / iters * 1e6);
+  printf("%-12s %12.0f %12.2f\n", "fork+exec", iters / t_exec,
+         t_exec / iters * 1e6);
+}
+
+// Time from a child's _exit to its parent's waitpid returning, for a
+// child with an empty store and for one holding `keys` keys. The store is
+// torn down off the exit path, so both should take about the same time.
+static double exit_latency(int keys) {
+  static int ks[MAX_BATCH], vs[MAX_BATCH];
+  int fds[2];
+  double t_exit;
+  pid_t pid;
+
+  if (pipe(fds)) {
+    perror("pipe");
+    exit(1);
+  }
+  pid = fork();
+  if (pid == 0) {
+    for (int base = 0; base < keys; base += MAX_BATCH) {
+      int n = keys - base < MAX_BATCH ? keys - base : MAX_BATCH;
+      for (int i = 0; i < n; i++) {
+        ks[i] = base + i;
+        vs[i] = i;
+      }
+      if (write_kv_batch(ks, vs, n) != n)
+        _exit(1);
+    }
+    t_exit = now_sec();
+    write(fds[1], &t_exit, sizeof(t_exit));
+    _exit(0);
+  }
+  close(fds[1]);
+  if (read(fds[0], &t_exit, sizeof(t_exit)) != sizeof(t_exit)) {
+    fprintf(stderr, "child failed to fill %d keys\n", keys);
+    exit(1);
+  }
+  waitpid(pid, NULL, 0);
+  close(fds[0]);
+  return now_sec() - t_exit;
+}
+
+void bench_exit(int keys) {
+  printf("\n=== Exit latency (_exit to waitpid) ===\n");
+  printf("%-12s %12s\n", "keys", "ms");
+  printf("%-12d %12.3f\n", 0, exit_latency(0) * 1e3);
+  printf("%-12d %12.3f\n", keys, exit_latency(keys) * 1e3);
+}
+
+// Slab + vmalloc usage in KiB, a rough measure of the store's footprint
+long kernel_mem_kb() {
+  FILE *fp = fopen("/proc/meminfo", "r");
+  char line[128];
+  long kb, total = 0;
+
+  if (!fp)
+    return 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "Slab: %ld kB", &kb) == 1 ||
+        sscanf(line, "VmallocUsed: %ld kB", &kb) == 1)
+      total += kb;
+  }
+  fclose(fp);
+  return total;
+}
+
+// Grow one store from 1K to max_keys keys and measure the average latency
+// of random hits at each size. With a resizing table the latency should
+// stay flat instead of growing with the chain length. The layout must be
+// chosen before the first write, so run each layout in a fresh process.
+void bench_sweep(int max_keys, int lookups, const char *layout) {
+  unsigned int seed = 1;
+  int filled = 0;
+  long mem0 = kernel_mem_kb();
+  int id = !strcmp(layout, "flat")      ? KV_LAYOUT_FLAT
+           : !strcmp(layout, "ordered") ? KV_LAYOUT_ORDERED
+                                        : KV_LAYOUT_HASH;
+
+  if (kv_ctl(KV_CTL_SET_LAYOUT, id)) {
+    perror("kv_ctl");
+    exit(1);
+  }
+  printf("\n=== Lookup latency vs key count (%s, %d lookups per size) ===\n",
+         layout, lookups);
+  printf("%-10s %14s %14s %14s\n", "keys", "insert ns/op", "lookup ns/op",
+         "kernel KiB");
+  for (int n = 1000; n <= max_keys; n *= 10) {
+    double t0, t_ins, t_look;
+    int inserted = n - filled;
+
+    t0 = now_sec();
+    for (; filled < n; filled++) {
+      if (write_kv(filled, filled)) {
+        fprintf(stderr, "write_kv(%d) failed\n", filled);
+        exit(1);
+      }
+    }
+    t_ins = now_sec() - t0;
+
+    t0 = now_sec();
+    for (int i = 0; i < lookups; i++) {
+      int k = rand_r(&seed) % n;
+      if (read_kv(k) != k) {
+        fprintf(stderr, "read_kv(%d) mismatch\n", k);
+        exit(1);
+      }
+    }
+    t_look = now_sec() - t0;
+
+    printf("%-10d %14.1f %14.1f %14ld\n", n, t_ins / inserted * 1e9,
+           t_look / lookups * 1e9, kernel_mem_kb() - mem0);
+  }
+}
+
+// Read latency through the user-mapped mirror against the read_kv syscall
+void bench_shared(int keys, int lookups) {
+  unsigned int nslots = 64, seed = 1;
+  struct kv_shared_hdr *hdr;
+  double t0, t_sys, t_map;
+  size_t size;
+  long sum = 0;
+  int fd;
+
+  while (nslots < (unsigned int)keys * 2)
+    nslots *= 2;
+  for (int i = 0; i < keys; i++)
+    write_kv(i, i);
+  fd = kv_ctl(KV_CTL_MAP_SHARED, nslots);
+  if (fd < 0) {
+    perror("kv_ctl(KV_CTL_MAP_SHARED)");
+    exit(1);
+  }
+  size = sizeof(*hdr) + nslots * sizeof(struct kv_shared_slot);
+  hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (hdr == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  printf("\n=== Mirror vs syscall reads (%d keys, %u slots) ===\n", keys,
+         nslots);
+  for (int i = 0; i < keys; i++)
+    if (kv_shared_read(hdr, i) != i) {
+      fprintf(stderr, "mirror(%d) mismatch\n", i);
+      exit(1);
+    }
+  write_kv(0, 42);
+  if (kv_shared_read(hdr, 0) != 42) {
+    fprintf(stderr, "mirror missed an update\n");
+    exit(1);
+  }
+
+  t0 = now_sec();
+  for (int i = 0; i < lookups; i++)
+    sum += read_kv(rand_r(&seed) % keys);
+  t_sys = now_sec() - t0;
+
+  seed = 1;
+  t0 = now_sec();
+  for (int i = 0; i < lookups; i++)
+    sum -= kv_shared_read(hdr, rand_r(&seed) % keys);
+  t_map = now_sec() - t0;
+
+  printf("%-10s %12s\n", "path", "ns/read");
+  printf("%-10s %12.1f\n", "syscall", t_sys / lookups * 1e9);
+  printf("%-10s %12.1f\n", "mirror", t_map / lookups * 1e9);
+  if (sum)
+    fprintf(stderr, "mirror and syscall disagree\n");
+  munmap(hdr, size);
+  close(fd);
+}
+
+// Dump the whole store with kv_scan and report entries per second
+void bench_scan(int keys, unsigned int max) {
+  int *ks = malloc(max * sizeof(int)), *vs = malloc(max * sizeof(int));
+  unsigned long cursor = 0;
+  long total = 0, calls = 0, sum = 0;
+  double t0, t;
+
+  for (int i = 0; i < keys; i++)
+    write_kv(i, i);
+
+  printf("\n=== kv_scan (%d keys, %u per call) ===\n", keys, max);
+  t0 = now_sec();
+  do {
+    long n = kv_scan(&cursor, ks, vs, max);
+    if (n < 0) {
+      perror("kv_scan");
+      exit(1);
+    }
+    for (long i = 0; i < n; i++)
+      sum += vs[i] - ks[i];
+    total += n;
+    calls++;
+  } while (cursor);
+  t = now_sec() - t0;
+
+  printf("entries %ld in %ld calls, %.3f M entries/s\n", total, calls,
+         total / t / 1e6);
+  if (total < keys || sum)
+    fprintf(stderr, "kv_scan returned %ld of %d keys\n", total, keys);
+  free(ks);
+  free(vs);
+}
+
+// Cache mode: cap the store at `limit` keys, stream `keys` distinct keys
+// through it while re-reading a hot set, then check how much of the hot
+// set survived eviction and that memory stayed bounded. Eviction work
+// per write is bounded, so also report the slowest write and check the
+// key count stayed within the limit plus its margin (limit / 16).
+void bench_cache(int limit, int keys) {
+  int hot = limit / 10, hits = 0;
+  long mem0 = kernel_mem_kb(), nkeys = -1;
+  double worst = 0, t;
+  char line[256];
+  FILE *f;
+
+  if (kv_ctl(KV_CTL_SET_LIMIT, limit) || kv_ctl(KV_CTL_SET_EVICT, 1)) {
+    perror("kv_ctl");
+    exit(1);
+  }
+  printf("\n=== Cache mode (limit %d, %d keys, hot set %d) ===\n", limit,
+         keys, hot);
+  for (int i = 0; i < keys; i++) {
+    t = now_sec();
+    if (write_kv(i, i) < 0) {
+      fprintf(stderr, "write_kv(%d) failed in cache mode\n", i);
+      exit(1);
+    }
+    t = now_sec() - t;
+    if (t > worst)
+      worst = t;
+    if (i % 4 == 0)
+      read_kv(i % hot);
+  }
+  for (int i = 0; i < hot; i++)
+    hits += read_kv(i) == i;
+  printf("hot set kept %d/%d, kernel memory +%ld KiB\n", hits, hot,
+         kernel_mem_kb() - mem0);
+
+  f = fopen("/proc/self/kv_stats", "r");
+  while (f && fgets(line, sizeof(line), f))
+    sscanf(line, "keys %ld", &nkeys);
+  if (f)
+    fclose(f);
+  printf("slowest write_kv %.1f us, %ld keys in the store\n", worst * 1e6,
+         nkeys);
+  if (nkeys > limit + limit / 16)
+    fprintf(stderr, "store holds %ld keys, over the limit of %d\n", nkeys,
+            limit);
+}
+
+// Write `keys` keys that expire after `ms`, then sleep past the expiry
+// without touching them and check that the reaper gave the memory back.
+void bench_ttl(int keys, int ms) {
+  long mem0 = kernel_mem_kb(), mem1, live = 0;
+  double t0;
+
+  printf("\n=== TTL expiry (%d keys, %d ms) ===\n", keys, ms);
+  t0 = now_sec();
+  for (int i = 0; i < keys; i++)
+    if (write_kv_ttl(i, i, ms) < 0) {
+      perror("write_kv_ttl");
+      exit(1);
+    }
+  printf("write_kv_ttl %.3f Mops/s\n", keys / (now_sec() - t0) / 1e6);
+  mem1 = kernel_mem_kb();
+
+  usleep((ms + 500) * 1000);
+  printf("kernel memory +%ld KiB after writes, +%ld KiB after expiry\n",
+         mem1 - mem0, kernel_mem_kb() - mem0);
+  for (int i = 0; i < keys; i++)
+    live += read_kv(i) != -1;
+  if (live)
+    fprintf(stderr, "%ld keys still readable after expiry\n", live);
+}
+
+static int pingpong_rounds;
+
+void *pong_thread(void *p) {
+  (void)p;
+  for (int i = 0; i < pingpong_rounds; i++) {
+    kv_wait(0, 2 * i, 0);
+    write_kv(0, 2 * i + 2);
+  }
+  return NULL;
+}
+
+// Two threads hand key 0 back and forth with write_kv + kv_wait. Reports
+// the round trip latency and the CPU time spent, which stays well below
+// the wall time since nobody polls.
+void bench_wait(int rounds) {
+  struct timespec c0, c1;
+  pthread_t t;
+  double t0, wall, cpu;
+
+  pingpong_rounds = rounds;
+  printf("\n=== kv_wait ping-pong (%d rounds) ===\n", rounds);
+
+  write_kv(0, 0);
+  pthread_create(&t, NULL, pong_thread, NULL);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0);
+  t0 = now_sec();
+  for (int i = 0; i < rounds; i++) {
+    write_kv(0, 2 * i + 1);
+    if (kv_wait(0, 2 * i + 1, 1000)) {
+      perror("kv_wait");
+      exit(1);
+    }
+  }
+  wall = now_sec() - t0;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1);
+  pthread_join(t, NULL);
+  cpu = (c1.tv_sec - c0.tv_sec) + (c1.tv_nsec - c0.tv_nsec) / 1e9;
+
+  printf("%.2f us/round, CPU %.0f%% of wall time over both threads\n",
+         wall / rounds * 1e6, cpu / wall * 100);
+}
+
+// Populate `keys` keys, then fork `children` children that each check a
+// sample of the inherited keys and overwrite one of them. Reports the
+// fork latency, which should not grow with `keys`.
+static double fork_children(int keys, int children) {
+  double t0, total = 0;
+
+  for (int c = 0; c < children; c++) {
+    int status;
+    pid_t pid;
+
+    t0 = now_sec();
+    pid = fork();
+    if (pid == 0) {
+      for (int i = 0; i < keys; i += keys / 1000 + 1)
+        if (read_kv(i) != i)
+          _exit(1);
+      write_kv(0, -2);
+      _exit(read_kv(0) != -2);
+    }
+    total += now_sec() - t0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "child %d did not see the parent's keys\n", c);
+      exit(1);
+    }
+  }
+  if (read_kv(0) != 0) {
+    fprintf(stderr, "a child's write leaked into the parent\n");
+    exit(1);
+  }
+  return total / children;
+}
+
+void bench_inherit(int keys, int children) {
+  static int ks[MAX_BATCH], vs[MAX_BATCH];
+  long mem0 = kernel_mem_kb();
+
+  printf("\n=== Copy-on-write fork (%d keys, %d children) ===\n", keys,
+         children);
+  if (kv_ctl(KV_CTL_SET_INHERIT, 1)) {
+    perror("kv_ctl(KV_CTL_SET_INHERIT)");
+    exit(1);
+  }
+  for (int base = 0; base < keys; base += MAX_BATCH) {
+    int n = keys - base < MAX_BATCH ? keys - base : MAX_BATCH;
+    for (int i = 0; i < n; i++)
+      ks[i] = vs[i] = base + i;
+    write_kv_batch(ks, vs, n);
+  }
+  printf("parent store +%ld KiB\n", kernel_mem_kb() - mem0);
+  printf("fork with inherit %.2f us\n", fork_children(keys, children) * 1e6);
+}
+
+// One process fills a named namespace, an unrelated child attaches to it
+// by name read-only and reads every key back.
+void bench_ns(int keys) {
+  const char *name = "kv_bench";
+  double t0, t_w;
+  int fd, status;
+  pid_t pid;
+
+  printf("\n=== Named namespace (%d keys) ===\n", keys);
+  fd = kv_attach(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    perror("kv_attach");
+    exit(1);
+  }
+  t0 = now_sec();
+  for (int i = 0; i < keys; i++)
+    kv_ns_write(fd, i, i);
+  t_w = now_sec() - t0;
+
+  pid = fork();
+  if (pid == 0) {
+    int rfd = kv_attach(name, O_RDONLY, 0), v, bad = 0;
+    double t_r;
+
+    if (rfd < 0) {
+      perror("kv_attach");
+      _exit(1);
+    }
+    if (kv_ns_write(rfd, 0, 1) == 0) {
+      fprintf(stderr, "read-only fd could write\n");
+      _exit(1);
+    }
+    t0 = now_sec();
+    for (int i = 0; i < keys; i++)
+      bad += kv_ns_read(rfd, i, &v) || v != i;
+    t_r = now_sec() - t0;
+    printf("%-10s %14s\n", "op", "Mops/s");
+    printf("%-10s %14.3f\n", "ns_write", keys / t_w / 1e6);
+    printf("%-10s %14.3f\n", "ns_read", keys / t_r / 1e6);
+    _exit(bad != 0);
+  }
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    fprintf(stderr, "child did not read the namespace back\n");
+  close(fd);
+}
+
+// Dump a store to a file, then load it into a fresh child process (the
+// store is not inherited) and read every key back.
+void bench_dump(int keys) {
+  static int ks[MAX_BATCH], vs[MAX_BATCH];
+  char path[] = "/tmp/kv_bench.XXXXXX";
+  double t0, t_d;
+  long n;
+  int fd, status;
+  pid_t pid;
+
+  printf("\n=== Dump and load (%d keys) ===\n", keys);
+  for (int base = 0; base < keys; base += MAX_BATCH) {
+    int cnt = keys - base < MAX_BATCH ? keys - base : MAX_BATCH;
+    for (int i = 0; i < cnt; i++) {
+      ks[i] = base + i;
+      vs[i] = -(base + i);
+    }
+    write_kv_batch(ks, vs, cnt);
+  }
+  fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(1);
+  }
+  unlink(path);
+
+  t0 = now_sec();
+  n = kv_dump(fd);
+  t_d = now_sec() - t0;
+  if (n != keys) {
+    fprintf(stderr, "kv_dump returned %ld\n", n);
+    exit(1);
+  }
+  printf("%-10s %10.3f s %8.1f MiB\n", "dump", t_d,
+         lseek(fd, 0, SEEK_END) / 1048576.0);
+
+  pid = fork();
+  if (pid == 0) {
+    int bad = 0;
+
+    lseek(fd, 0, SEEK_SET);
+    t0 = now_sec();
+    n = kv_load(fd);
+    printf("%-10s %10.3f s\n", "load", now_sec() - t0);
+    if (n != keys) {
+      fprintf(stderr, "kv_load returned %ld\n", n);
+      _exit(1);
+    }
+    for (int base = 0; base < keys; base += MAX_BATCH) {
+      int cnt = keys - base < MAX_BATCH ? keys - base : MAX_BATCH;
+      for (int i = 0; i < cnt; i++)
+        ks[i] = base + i;
+      read_kv_batch(ks, vs, cnt);
+      for (int i = 0; i < cnt; i++)
+        bad += vs[i] != -(base + i);
+    }
+    _exit(bad != 0);
+  }
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    fprintf(stderr, "child did not read the loaded keys back\n");
+  close(fd);
+}
+
+// Time write_kv/read_kv with the stats counters on, then check that
+// /proc/self/kv_stats accounted for every call and print it.
+void bench_stats(int keys) {
+  unsigned long long reads = 0, writes = 0;
+  char line[256];
+  double t0, t_w, t_r;
+  FILE *f;
+
+  printf("\n=== /proc/self/kv_stats (%d keys) ===\n", keys);
+  t0 = now_sec();
+  for (int i = 0; i < keys; i++)
+    write_kv(i, i);
+  t_w = now_sec() - t0;
+  t0 = now_sec();
+  for (int i = 0; i < 2 * keys; i++)
+    read_kv(i); // half of them miss
+  t_r = now_sec() - t0;
+  printf("%-10s %14s\n", "op", "Mops/s");
+  printf("%-10s %14.3f\n", "write_kv", keys / t_w / 1e6);
+  printf("%-10s %14.3f\n", "read_kv", 2 * keys / t_r / 1e6);
+
+  f = fopen("/proc/self/kv_stats", "r");
+  if (!f) {
+    perror("/proc/self/kv_stats");
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    sscanf(line, "reads %llu", &reads);
+    sscanf(line, "writes %llu", &writes);
+    fputs(line, stdout);
+  }
+  fclose(f);
+  if (reads != 2ULL * keys || writes != (unsigned long long)keys)
+    fprintf(stderr, "kv_stats counted %llu reads, %llu writes\n", reads,
+            writes);
+}
+
+// Ordered layout: fill every other key, then read ranges of `width`
+// keys with one kv_range call each and with one read_kv per key.
+void bench_range(int keys, int width, int rounds) {
+  int *ks = malloc(width * sizeof(int)), *vs = malloc(width * sizeof(int));
+  unsigned int seed = 1;
+  double t0, t_range, t_probe;
+  long found = 0, probed = 0;
+
+  if (kv_ctl(KV_CTL_SET_LAYOUT, KV_LAYOUT_ORDERED)) {
+    perror("kv_ctl(KV_CTL_SET_LAYOUT)");
+    exit(1);
+  }
+  for (int i = 0; i < keys; i++)
+    write_kv(2 * i, i);
+
+  printf("\n=== kv_range vs read_kv (%d keys, width %d) ===\n", keys, width);
+  t0 = now_sec();
+  for (int r = 0; r < rounds; r++) {
+    long lo = rand_r(&seed) % (2L * keys), n;
+
+    n = kv_range(lo, lo + width, ks, vs, width);
+    if (n < 0) {
+      perror("kv_range");
+      exit(1);
+    }
+    for (long i = 0; i < n; i++)
+      if (ks[i] < lo || ks[i] >= lo + width || ks[i] % 2 || vs[i] != ks[i] / 2 ||
+          (i && ks[i] <= ks[i - 1])) {
+        fprintf(stderr, "kv_range returned a bad entry\n");
+        exit(1);
+      }
+    found += n;
+  }
+  t_range = now_sec() - t0;
+
+  seed = 1;
+  t0 = now_sec();
+  for (int r = 0; r < rounds; r++) {
+    long lo = rand_r(&seed) % (2L * keys);
+
+    for (long k = lo; k < lo + width; k++)
+      probed += read_kv(k) >= 0;
+  }
+  t_probe = now_sec() - t0;
+
+  printf("%-10s %14s\n", "method", "us/range");
+  printf("%-10s %14.3f\n", "kv_range", t_range / rounds * 1e6);
+  printf("%-10s %14.3f\n", "read_kv", t_probe / rounds * 1e6);
+  if (found != probed)
+    fprintf(stderr, "kv_range found %ld entries, read_kv %ld\n", found,
+            probed);
+  free(ks);
+  free(vs);
+}
+
+// Store `size`-byte values under `keys` 64-bit keys with one
+// write_kv_blob each and read them back, against splitting the same
+// bytes over one write_kv per int.
+void bench_blob(int keys, int size) {
+  int words = (size + 3) / 4;
+  int *buf = calloc(words, sizeof(int)), *out = calloc(words, sizeof(int));
+  double t0, t_blob_w, t_blob_r, t_int_w;
+  long mem0 = kernel_mem_kb();
+
+  printf("\n=== Blob values (%d keys of %d bytes) ===\n", keys, size);
+  t0 = now_sec();
+  for (int i = 0; i < keys; i++) {
+    buf[0] = i;
+    if (write_kv_blob((uint64_t)i << 32 | 0xb10b, buf, size)) {
+      perror("write_kv_blob");
+      exit(1);
+    }
+  }
+  t_blob_w = now_sec() - t0;
+  printf("blob store +%ld KiB\n", kernel_mem_kb() - mem0);
+
+  t0 = now_sec();
+  for (int i = 0; i < keys; i++) {
+    if (read_kv_blob((uint64_t)i << 32 | 0xb10b, out, size) != size ||
+        out[0] != i) {
+      fprintf(stderr, "read_kv_blob(%d) mismatch\n", i);
+      exit(1);
+    }
+  }
+  t_blob_r = now_sec() - t0;
+
+  t0 = now_sec();
+  for (int i = 0; i < keys && i < 1000; i++)
+    for (int w = 0; w < words; w++)
+      write_kv(i * words + w, buf[w]);
+  t_int_w = (now_sec() - t0) / (keys < 1000 ? keys : 1000) * keys;
+
+  printf("%-16s %14s\n", "op", "us/value");
+  printf("%-16s %14.3f\n", "write_kv_blob", t_blob_w / keys * 1e6);
+  printf("%-16s %14.3f\n", "read_kv_blob", t_blob_r / keys * 1e6);
+  printf("%-16s %14.3f\n", "write_kv x words", t_int_w / keys * 1e6);
+  free(buf);
+  free(out);
+}
+
+// Mixed read/write load from 1 to max_threads threads. Each thread runs
+// through a pregenerated sequence of MIX_OPS operations, so drawing keys
+// costs nothing during the run, and times every syscall into a
+// log-linear histogram: 32 sub-buckets per power of two above 64 ns,
+// which bounds the percentile error to about 3%. Results are printed as
+// JSON, one object per thread count.
+#define MIX_OPS (1 << 20)
+#define MIX_SUB_BITS 5
+#define MIX_BUCKETS (64 + (64 - 6) * (1 << MIX_SUB_BITS))
+
+struct mix_arg {
+  const int *keys;
+  const unsigned char *is_read;
+  double seconds;
+  long ops;
+  uint64_t hist[MIX_BUCKETS];
+};
+
+static int mix_bucket(uint64_t ns) {
+  int msb, shift;
+
+  if (ns < 64)
+    return ns;
+  msb = 63 - __builtin_clzll(ns);
+  shift = msb - MIX_SUB_BITS;
+  return 64 + (msb - 6) * (1 << MIX_SUB_BITS) +
+         (int)((ns >> shift) - (1 << MIX_SUB_BITS));
+}
+
+static uint64_t mix_bucket_ns(int b) {
+  int msb, sub;
+
+  if (b < 64)
+    return b;
+  msb = (b - 64) / (1 << MIX_SUB_BITS) + 6;
+  sub = (b - 64) % (1 << MIX_SUB_BITS);
+  return (uint64_t)((1 << MIX_SUB_BITS) + sub) << (msb - MIX_SUB_BITS);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *mix_thread(void *p) {
+  struct mix_arg *arg = p;
+  long ops = 0;
+  double end;
+
+  while (!start_flag)
+    ;
+  end = now_sec() + arg->seconds;
+  while (now_sec() < end) {
+    for (int i = 0; i < 1024; i++, ops++) {
+      int j = ops & (MIX_OPS - 1);
+      uint64_t t0 = now_ns();
+
+      if (arg->is_read[j])
+        read_kv(arg->keys[j]);
+      else
+        write_kv(arg->keys[j], j);
+      arg->hist[mix_bucket(now_ns() - t0)]++;
+    }
+  }
+  arg->ops = ops;
+  return NULL;
+}
+
+static uint64_t mix_percentile(const uint64_t *hist, long total, double q) {
+  long want = (long)(total * q), seen = 0;
+
+  for (int b = 0; b < MIX_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > want)
+      return mix_bucket_ns(b);
+  }
+  return mix_bucket_ns(MIX_BUCKETS - 1);
+}
+
+// dist: "uniform" over [0, keys), "zipf" with s = 1 (key r drawn with
+// probability proportional to 1 / (r + 1)), or "stride", uniform over
+// multiples of 1024, which would share one bucket in any table indexed
+// by the low bits of the key rather than by its hash.
+void bench_mix(int max_threads, int keys, int read_pct, const char *dist,
+               double seconds) {
+  double *cdf = NULL, base = 0;
+  int first = 1;
+
+  if (strcmp(dist, "uniform") && strcmp(dist, "zipf") &&
+      strcmp(dist, "stride")) {
+    fprintf(stderr, "unknown distribution %s\n", dist);
+    exit(1);
+  }
+  if (!strcmp(dist, "zipf")) {
+    double sum = 0;
+
+    cdf = malloc(keys * sizeof(double));
+    for (int r = 0; r < keys; r++)
+      cdf[r] = sum += 1.0 / (r + 1);
+    for (int r = 0; r < keys; r++)
+      cdf[r] /= sum;
+  }
+  for (int i = 0; i < keys; i++)
+    write_kv(strcmp(dist, "stride") ? i : i * 1024, i);
+
+  printf("{\"benchmark\": \"mix\", \"keys\": %d, \"read_pct\": %d, "
+         "\"dist\": \"%s\", \"seconds\": %.1f, \"results\": [",
+         keys, read_pct, dist, seconds);
+  if (max_threads < 1)
+    max_threads = 1;
+  // 1, 2, 4, ... and max_threads itself
+  for (int n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+    pthread_t tids[n];
+    struct mix_arg *args = calloc(n, sizeof(*args));
+    uint64_t *hist = calloc(MIX_BUCKETS, sizeof(uint64_t));
+    long total = 0;
+    double ops_s;
+
+    start_flag = 0;
+    for (int i = 0; i < n; i++) {
+      unsigned int seed = i + 1;
+      int *ks = malloc(MIX_OPS * sizeof(int));
+      unsigned char *rd = malloc(MIX_OPS);
+
+      for (int j = 0; j < MIX_OPS; j++) {
+        int k = rand_r(&seed) % keys;
+
+        if (cdf) {
+          double u = (double)rand_r(&seed) / RAND_MAX;
+          int lo = 0, hi = keys - 1;
+
+          while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+              lo = mid + 1;
+            else
+              hi = mid;
+          }
+          k = lo;
+        } else if (!strcmp(dist, "stride")) {
+          k *= 1024;
+        }
+        ks[j] = k;
+        rd[j] = rand_r(&seed) % 100 < read_pct;
+      }
+      args[i].keys = ks;
+      args[i].is_read = rd;
+      args[i].seconds = seconds;
+      pthread_create(&tids[i], NULL, mix_thread, &args[i]);
+    }
+    start_flag = 1;
+    for (int i = 0; i < n; i++) {
+      pthread_join(tids[i], NULL);
+      total += args[i].ops;
+      for (int b = 0; b < MIX_BUCKETS; b++)
+        hist[b] += args[i].hist[b];
+      free((void *)args[i].keys);
+      free((void *)args[i].is_read);
+    }
+    ops_s = total / seconds;
+    if (n == 1)
+      base = ops_s;
+    printf("%s\n  {\"threads\": %d, \"ops_per_sec\": %.0f, \"p50_ns\": %llu, "
+           "\"p99_ns\": %llu, \"p999_ns\": %llu, \"efficiency\": %.3f}",
+           first ? "" : ",", n, ops_s,
+           (unsigned long long)mix_percentile(hist, total, 0.50),
+           (unsigned long long)mix_percentile(hist, total, 0.99),
+           (unsigned long long)mix_percentile(hist, total, 0.999),
+           ops_s / (n * base));
+    fflush(stdout);
+    first = 0;
+    free(args);
+    free(hist);
+    if (n == max_threads)
+      break;
+  }
+  printf("\n]}\n");
+  free(cdf);
+}
+
+struct snap_writer_arg {
+  int keys;
+  volatile int stop;
+};
+
+// Writes generation g to keys 0..keys-1 in order, then g + 1, and so on,
+// so a consistent view never has a key newer than a lower one.
+void *snap_writer(void *p) {
+  struct snap_writer_arg *arg = p;
+
+  for (int g = 1; !arg->stop; g++)
+    for (int i = 0; i < arg->keys; i++)
+      write_kv(i, g);
+  return NULL;
+}
+
+static int snap_torn(const int *vs, int keys) {
+  for (int i = 1; i < keys; i++)
+    if (vs[i] > vs[i - 1] || vs[0] - vs[i] > 1)
+      return 1;
+  return 0;
+}
+
+// A writer thread keeps rewriting all keys while the main thread reads
+// them all, `rounds` times with read_kv and `rounds` times through a
+// fresh kv_snapshot, counting the rounds that saw a torn mix.
+void bench_snapshot(int keys, int rounds) {
+  struct snap_writer_arg arg = {keys, 0};
+  int *vs = malloc(keys * sizeof(int));
+  int torn_live = 0, torn_snap = 0;
+  double t0, t_snap = 0, t_read = 0;
+  long mem0, mem1 = 0;
+  pthread_t tid;
+
+  for (int i = 0; i < keys; i++)
+    write_kv(i, 0);
+  pthread_create(&tid, NULL, snap_writer, &arg);
+
+  printf("\n=== Snapshot reads (%d keys, %d rounds) ===\n", keys, rounds);
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < keys; i++)
+      vs[i] = read_kv(i);
+    torn_live += snap_torn(vs, keys);
+  }
+  for (int r = 0; r < rounds; r++) {
+    int fd;
+
+    t0 = now_sec();
+    fd = kv_snapshot(O_CLOEXEC);
+    t_snap += now_sec() - t0;
+    if (fd < 0) {
+      perror("kv_snapshot");
+      exit(1);
+    }
+    t0 = now_sec();
+    for (int i = 0; i < keys; i++)
+      kv_ns_read(fd, i, &vs[i]);
+    t_read += now_sec() - t0;
+    torn_snap += snap_torn(vs, keys);
+    close(fd);
+  }
+  arg.stop = 1;
+  pthread_join(tid, NULL);
+
+  printf("torn rounds: read_kv %d/%d, snapshot %d/%d\n", torn_live, rounds,
+         torn_snap, rounds);
+  printf("kv_snapshot %.2f us, read through it %.3f Mops/s\n",
+         t_snap / rounds * 1e6, (double)keys * rounds / t_read / 1e6);
+  if (torn_snap)
+    fprintf(stderr, "a snapshot saw a torn view\n");
+
+  // A monitor taking a snapshot, reading it and closing it, with 1% of
+  // the keys rewritten in between. Each snapshot should cost what was
+  // written since the last one, and memory should not grow with rounds.
+  mem0 = kernel_mem_kb();
+  t_snap = 0;
+  for (int r = 0; r < rounds; r++) {
+    int fd;
+
+    for (int i = 0; i < keys; i += 100)
+      write_kv(i, r);
+    t0 = now_sec();
+    fd = kv_snapshot(O_CLOEXEC);
+    t_snap += now_sec() - t0;
+    if (fd < 0) {
+      perror("kv_snapshot");
+      exit(1);
+    }
+    kv_ns_read(fd, 0, &vs[0]);
+    close(fd);
+    if (r == 0)
+      mem1 = kernel_mem_kb();
+  }
+  printf("repeated kv_snapshot %.2f us, kernel memory +%ld KiB after the "
+         "first, +%ld KiB after all\n",
+         t_snap / rounds * 1e6, mem1 - mem0, kernel_mem_kb() - mem0);
+  free(vs);
+}
+
+static double write_all(int keys, int v) {
+  double t0 = now_sec();
+
+  for (int i = 0; i < keys; i++)
+    write_kv(i, v);
+  return (now_sec() - t0) / keys;
+}
+
+// Cost of write_kv with no watches and with `watched` keys watched, which
+// should be the same for unwatched keys, and the write -> eventfd read
+// round trip of a watched key.
+void bench_watch(int keys, int watched, int rounds) {
+  int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  double t_none, t_some, t0;
+  uint64_t cnt;
+
+  if (efd < 0) {
+    perror("eventfd");
+    exit(1);
+  }
+  printf("\n=== Watched keys (%d keys, %d watched) ===\n", keys, watched);
+  write_all(keys, 0);
+  t_none = write_all(keys, 1);
+  // Watch the keys above the range that is written below
+  for (int i = 0; i < watched; i++) {
+    if (kv_watch(keys + i, efd)) {
+      perror("kv_watch");
+      exit(1);
+    }
+  }
+  t_some = write_all(keys, 2);
+  if (read(efd, &cnt, sizeof(cnt)) > 0) {
+    fprintf(stderr, "an unwatched write signalled the eventfd\n");
+    exit(1);
+  }
+  printf("write_kv %.1f ns unwatched, %.1f ns with watches elsewhere\n",
+         t_none * 1e9, t_some * 1e9);
+
+  t0 = now_sec();
+  for (int r = 0; r < rounds; r++) {
+    write_kv(keys, r);
+    if (read(efd, &cnt, sizeof(cnt)) != sizeof(cnt) || cnt != 1) {
+      fprintf(stderr, "watched write %d was not signalled once\n", r);
+      exit(1);
+    }
+  }
+  printf("watched write + eventfd read %.2f us\n",
+         (now_sec() - t0) / rounds * 1e6);
+  for (int i = 0; i < watched; i++)
+    kv_watch(keys + i, -1);
+  close(efd);
+}
+
+// Read throughput of `threads` threads spread over all CPUs, in a child
+// process with a fresh store homed on `node` (-1 for the caller's node),
+// first as is and then with per-node replicas. On a multi-socket machine
+// the replicas keep reads off the interconnect; on one node they only
+// measure the cost of the extra probe.
+static void numa_run(const char *mode, int keys, int threads, double seconds,
+                     int node, int replicas) {
+  int status;
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    pthread_t tids[threads];
+    struct reader_arg args[threads];
+    unsigned long nslots = 64;
+    long total = 0;
+
+    while (nslots < 2UL * keys && nslots < 1UL << 22)
+      nslots <<= 1;
+    if (kv_ctl(KV_CTL_SET_NODE, node)) {
+      perror("kv_ctl(KV_CTL_SET_NODE)");
+      _exit(1);
+    }
+    for (int i = 0; i < keys; i++)
+      write_kv(i, i);
+    if (replicas && kv_ctl(KV_CTL_SET_REPLICAS, nslots)) {
+      perror("kv_ctl(KV_CTL_SET_REPLICAS)");
+      _exit(1);
+    }
+    start_flag = 0;
+    for (int i = 0; i < threads; i++) {
+      args[i] = (struct reader_arg){keys, seconds, i + 1, 0};
+      pthread_create(&tids[i], NULL, reader_thread, &args[i]);
+    }
+    start_flag = 1;
+    for (int i = 0; i < threads; i++) {
+      pthread_join(tids[i], NULL);
+      total += args[i].ops;
+    }
+    printf("%-10s %14.3f\n", mode, total / seconds / 1e6);
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    exit(1);
+}
+
+void bench_numa(int keys, int threads, double seconds, int node) {
+  printf("\n=== NUMA placement (%d keys, %d threads, node %d) ===\n", keys,
+         threads, node);
+  printf("%-10s %14s\n", "mode", "read Mops/s");
+  fflush(stdout);
+  numa_run("home", keys, threads, seconds, node, 0);
+  numa_run("replicas", keys, threads, seconds, node, 1);
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s batch [keys]\n", prog);
+  fprintf(stderr, "       %s readscale [keys] [max_threads] [seconds]\n",
+          prog);
+  fprintf(stderr, "       %s fork [iterations]\n", prog);
+  fprintf(stderr, "       %s exit [keys]\n", prog);
+  fprintf(stderr,
+          "       %s sweep [max_keys] [lookups] [hash|flat|ordered]\n",
+          prog);
+  fprintf(stderr, "       %s shared [keys] [lookups]\n", prog);
+  fprintf(stderr, "       %s scan [keys] [max]\n", prog);
+  fprintf(stderr, "       %s cache [limit] [keys]\n", prog);
+  fprintf(stderr, "       %s ttl [keys] [ms]\n", prog);
+  fprintf(stderr, "       %s wait [rounds]\n", prog);
+  fprintf(stderr, "       %s inherit [keys] [children]\n", prog);
+  fprintf(stderr, "       %s ns [keys]\n", prog);
+  fprintf(stderr, "       %s dump [keys]\n", prog);
+  fprintf(stderr, "       %s stats [keys]\n", prog);
+  fprintf(stderr, "       %s range [keys] [width] [rounds]\n", prog);
+  fprintf(stderr, "       %s blob [keys] [size]\n", prog);
+  fprintf(stderr,
+          "       %s mix [max_threads] [keys] [read_pct] "
+          "[uniform|zipf|stride] [seconds]\n",
+          prog);
+  fprintf(stderr, "       %s snapshot [keys] [rounds]\n", prog);
+  fprintf(stderr, "       %s numa [keys] [threads] [seconds] [node]\n", prog);
+  fprintf(stderr, "       %s watch [keys] [watched] [rounds]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+    usage(argv[0]);
+
+  if (!strcmp(argv[1], "batch")) {
+    bench_batch(argc > 2 ? atoi(argv[2]) : 1 << 20);
+  } else if (!strcmp(argv[1], "readscale")) {
+    bench_readscale(argc > 2 ? atoi(argv[2]) : 1 << 16,
+                    argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN),
+                    argc > 4 ? atof(argv[4]) : 2.0);
+  } else if (!strcmp(argv[1], "fork")) {
+    bench_fork(argc > 2 ? atoi(argv[2]) : 10000);
+  } else if (!strcmp(argv[1], "exit")) {
+    bench_exit(argc > 2 ? atoi(argv[2]) : 10000000);
+  } else if (!strcmp(argv[1], "sweep")) {
+    bench_sweep(argc > 2 ? atoi(argv[2]) : 10000000,
+                argc > 3 ? atoi(argv[3]) : 1000000,
+                argc > 4 ? argv[4] : "hash");
+  } else if (!strcmp(argv[1], "shared")) {
+    bench_shared(argc > 2 ? atoi(argv[2]) : 1024,
+                 argc > 3 ? atoi(argv[3]) : 1000000);
+  } else if (!strcmp(argv[1], "scan")) {
+    bench_scan(argc > 2 ? atoi(argv[2]) : 1000000,
+               argc > 3 ? atoi(argv[3]) : 65536);
+  } else if (!strcmp(argv[1], "cache")) {
+    bench_cache(argc > 2 ? atoi(argv[2]) : 100000,
+                argc > 3 ? atoi(argv[3]) : 10000000);
+  } else if (!strcmp(argv[1], "ttl")) {
+    bench_ttl(argc > 2 ? atoi(argv[2]) : 1000000,
+              argc > 3 ? atoi(argv[3]) : 1000);
+  } else if (!strcmp(argv[1], "wait")) {
+    bench_wait(argc > 2 ? atoi(argv[2]) : 100000);
+  } else if (!strcmp(argv[1], "inherit")) {
+    bench_inherit(argc > 2 ? atoi(argv[2]) : 1000000,
+                  argc > 3 ? atoi(argv[3]) : 100);
+  } else if (!strcmp(argv[1], "ns")) {
+    bench_ns(argc > 2 ? atoi(argv[2]) : 1000000);
+  } else if (!strcmp(argv[1], "dump")) {
+    bench_dump(argc > 2 ? atoi(argv[2]) : 10000000);
+  } else if (!strcmp(argv[1], "stats")) {
+    bench_stats(argc > 2 ? atoi(argv[2]) : 1000000);
+  } else if (!strcmp(argv[1], "range")) {
+    bench_range(argc > 2 ? atoi(argv[2]) : 1000000,
+                argc > 3 ? atoi(argv[3]) : 1000,
+                argc > 4 ? atoi(argv[4]) : 10000);
+  } else if (!strcmp(argv[1], "blob")) {
+    bench_blob(argc > 2 ? atoi(argv[2]) : 100000,
+               argc > 3 ? atoi(argv[3]) : 4096);
+  } else if (!strcmp(argv[1], "mix")) {
+    bench_mix(argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN),
+              argc > 3 ? atoi(argv[3]) : 1 << 16,
+              argc > 4 ? atoi(argv[4]) : 90, argc > 5 ? argv[5] : "uniform",
+              argc > 6 ? atof(argv[6]) : 2.0);
+  } else if (!strcmp(argv[1], "snapshot")) {
+    bench_snapshot(argc > 2 ? atoi(argv[2]) : 100000,
+                   argc > 3 ? atoi(argv[3]) : 100);
+  } else if (!strcmp(argv[1], "numa")) {
+    bench_numa(argc > 2 ? atoi(argv[2]) : 1 << 16,
+               argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN),
+               argc > 4 ? atof(argv[4]) : 2.0,
+               argc > 5 ? atoi(argv[5]) : -1);
+  } else if (!strcmp(argv[1], "watch")) {
+    bench_watch(argc > 2 ? atoi(argv[2]) : 1000000,
+                argc > 3 ? atoi(argv[3]) : 1000,
+                argc > 4 ? atoi(argv[4]) : 100000);
+  } else {
+    usage(argv[0]);
+  }
+  return 0;
+}
@@ -726,13 +726,43 @@ struct kmap_ctrl {
 struct kv_node {
 	int key;
 	int value;
+	bool referenced;	/* CLOCK bit for KV_CTL_SET_EVICT */
+	bool watched;		/* has a kv_watch, under the bucket lock */
+	unsigned long expires;	/* jiffies, 0 if the key does not expire */
 	struct hlist_node node;
+	struct rcu_head rcu;
 };
 
-struct kv_bucket {
-	struct hlist_head head;
-	spinlock_t lock;
-};
+/* Per thread group KV store, hangs off signal_struct */
+struct kv_store;
+
+/* kv_ctl() operations */
+#define KV_CTL_SET_LAYOUT	1
+#define KV_CTL_GET_LAYOUT	2
+#define KV_CTL_MAP_SHARED	3	/* arg: mirror slots, returns an fd */
+#define KV_CTL_SET_LIMIT	4	/* arg: max int keys (not blobs), 0 for none */
+#define KV_CTL_SET_EVICT	5	/* arg: 1 to evict instead of failing */
+#define KV_CTL_SET_INHERIT	6	/* arg: 1 to share the store with forks */
+#define KV_CTL_SET_NODE		7	/* arg: NUMA node, -1 for the caller's */
+#define KV_CTL_SET_REPLICAS	8	/* arg: slots of each per-node replica */
+
+/* Store layouts, chosen before the first write_kv */
+#define KV_LAYOUT_HASH		0	/* chained hash of kv_node */
+#define KV_LAYOUT_FLAT		1	/* open addressing, flat arrays */
+#define KV_LAYOUT_ORDERED	2	/* rbtree sorted by key, for kv_range */
+
+extern struct kmem_cache *kv_node_cachep;
+extern struct kv_store *get_kv_store(struct kv_store *store);
+extern void put_kv_store(struct kv_store *store);
+extern struct kv_store *kv_store_fork(struct kv_store *parent);
+/* For IORING_OP_KV_READ and IORING_OP_KV_WRITE in io_uring/kv.c */
+extern struct kv_store *kv_store_get_current(bool alloc);
+extern long kv_store_write(struct kv_store *store, int k, int v);
+extern long kv_store_try_write(struct kv_store *store, int k, int v);
+extern long kv_store_read(struct kv_store *store, int k, int *v);
+/* /proc/<pid>/kv_stats, listed in tgid_base_stuff */
+extern int proc_pid_kv_stats(struct seq_file *m, struct pid_namespace *ns,
+			     struct pid *pid, struct task_struct *task);
 
 struct task_struct {
 #ifdef CONFIG_THREAD_INFO_IN_TASK
@@ -1511,8 +1541,6 @@ struct task_struct {
 	struct callback_head		l1d_flush_kill;
 #endif
 
-	struct kv_bucket *kv_store[1024];
-
 	int socket_count;
 	int socket_limit;
 	int socket_priority;
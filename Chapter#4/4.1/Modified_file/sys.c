@@ -49,7 +49,25 @@
 #include <linux/kprobes.h>
 #include <linux/user_namespace.h>
 #include <linux/time_namespace.h>
+#include <linux/ipc_namespace.h>
 #include <linux/binfmts.h>
+#include <linux/sort.h>
+#include <linux/percpu.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/anon_inodes.h>
+#include <linux/vmalloc.h>
+#include <linux/bitrev.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/rbtree.h>
+#include <linux/rhashtable.h>
+#include <linux/llist.h>
+#include <linux/eventfd.h>
+#include <linux/log2.h>
+#include <linux/mempolicy.h>
+#include <linux/memcontrol.h>
+#include <linux/seq_file.h>
 
 #include <linux/sched.h>
 #include <linux/sched/autogroup.h>
@@ -59,6 +77,7 @@
 #include <linux/sched/coredump.h>
 #include <linux/sched/task.h>
 #include <linux/sched/cputime.h>
+#include <linux/sched/clock.h>
 #include <linux/rcupdate.h>
 #include <linux/uidgid.h>
 #include <linux/cred.h>
@@ -75,6 +94,9 @@
 
 #include "uid16.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/kv.h>
+
 #ifndef SET_UNALIGN_CTL
 # define SET_UNALIGN_CTL(a, b)	(-EINVAL)
 #endif
@@ -2793,52 +2815,4103 @@ COMPAT_SYSCALL_DEFINE1(sysinfo, struct compat_sysinfo __user *, info)
  * Define new syscall write_kv and read_kv
  */
 
-SYSCALL_DEFINE2(write_kv, int, k, int, v) {
-	struct task_struct *p = current;
-	unsigned int hash = k % 1024;
-	struct kv_bucket *bucket = p->kv_store[hash];
-	struct kv_node *entry;
-	bool find = false;
-	spin_lock(&bucket->lock);
-	hlist_for_each_entry(entry, &bucket->head, node) {
-		if (entry->key == k) {
-			entry->value = v;
-			find = true;
+/*
+ * The store is a chained hash table that is resized on load factor by a
+ * work item, one bucket at a time:
+ *
+ *  - the resizer publishes the new table as store->table and keeps the
+ *    one being drained in store->old_table;
+ *  - a key lives in its old_table bucket until that bucket is marked
+ *    moved, and in its store->table bucket afterwards;
+ *  - moving a bucket happens under its lock and inside its seqcount, so
+ *    writers re-check ->moved after locking and lock-free readers retry
+ *    a walk that raced with a move.
+ *
+ * Syscalls never rehash more than they insert; the resize work does.
+ */
+#define KV_MIN_BUCKETS 64
+#define KV_MAX_BUCKETS (1U << 24)
+
+struct kv_bucket {
+	struct hlist_head head;
+	spinlock_t lock;
+	seqcount_spinlock_t seq;
+	bool moved;	/* drained into a newer table */
+};
+
+struct kv_table {
+	unsigned int size;	/* power of two */
+	refcount_t refs;	/* > 1 only for a base shared after fork */
+	struct kv_cow *cow;	/* same for both tables during a resize */
+	struct rcu_head rcu;
+	struct kv_bucket buckets[];
+};
+
+/*
+ * KV_CTL_SET_INHERIT: fork shares the store copy-on-write. The parent's
+ * table is frozen as a refcounted base and parent and child both carry
+ * on with a small empty table of their own whose ->cow points at it.
+ * A bucket of the base is copied into the live table the first time a
+ * key of it is written, and marked in ->copied; lookups of keys whose
+ * base bucket is not marked fall through to the base. Bases are always
+ * self-contained: a parent that wrote since its last inheriting fork
+ * copies what is left of its base before it is frozen again. So fork is
+ * only O(1) when the parent has not written since its last inheriting
+ * fork and can share the same base. Otherwise fork pays for copying the
+ * rest of the base, up to every key in the store. It also waits for a
+ * grace period when other threads may be using the store.
+ * The resize work lets go of a base once every bucket of it has been
+ * copied, and takes it back as the live table once no other store
+ * shares it, so a base does not outlive the stores that need it.
+ */
+struct kv_cow {
+	struct kv_table *base;		/* frozen, never written */
+	unsigned long *copied;		/* bitmap over base buckets, lazy */
+	unsigned int nr_copied;		/* bits set in ->copied, cow_mutex */
+	long nr_keys;			/* in base buckets not copied yet */
+};
+
+/*
+ * KV_LAYOUT_FLAT: open addressing over flat key/value arrays, in groups
+ * of KV_FLAT_GROUP slots in the style of Swiss tables. Every slot has a
+ * control byte, KV_FLAT_EMPTY or the low 7 bits of the key's hash, and a
+ * group's control bytes are matched a word at a time, so a probe reads
+ * one group instead of chasing a chain of nodes. Slots are never freed or
+ * reused within a table, so readers only need the acquire on ->ctrl.
+ * Writers are serialised by store->flat_lock. Growing works as for the
+ * chained layout: new writes go to the new table, readers look there
+ * first and then in the old one, and the resize work copies the rest.
+ */
+#define KV_FLAT_GROUP 8
+#define KV_FLAT_EMPTY 0x80
+#define KV_FLAT_LO 0x0101010101010101ULL
+#define KV_FLAT_HI 0x8080808080808080ULL
+#define KV_FLAT_MIN_GROUPS 8
+#define KV_FLAT_MAX_GROUPS (1U << 24)
+
+struct kv_flat_group {
+	u64 ctrl;	/* byte j is the control byte of slot j */
+	int keys[KV_FLAT_GROUP];
+	int vals[KV_FLAT_GROUP];
+};
+
+struct kv_flat {
+	unsigned int ngroups;	/* power of two */
+	unsigned int used;	/* full slots, under flat_lock */
+	struct rcu_head rcu;
+	struct kv_flat_group groups[];
+};
+
+/*
+ * KV_LAYOUT_ORDERED: an rbtree of kv_onode sorted by key, for kv_range.
+ * Writers hold store->flat_lock and bump store->ord_seq around inserts,
+ * whose rotations a lockless reader can race with. Readers descend
+ * under rcu_read_lock() with rcu_dereference_raw() on the child links:
+ * a descent can miss a node while the tree is being rebalanced but
+ * never loops, and a miss is only trusted if ord_seq did not move. Nodes
+ * are only freed with the store, so keys cannot be deleted or evicted.
+ */
+struct kv_onode {
+	int key;
+	int value;
+	bool watched;	/* has a kv_watch, under flat_lock */
+	struct rb_node rb;
+};
+
+/*
+ * Keys written by write_kv_ttl carry node->expires. Lookups ignore
+ * expired nodes and read_kv unlinks the one it trips over. Everything
+ * else is left to a per-store reaper driven by a coarse timer wheel of
+ * KV_TTL_SLOTS ticks of KV_TTL_TICK: each TTL write drops a (key, tick)
+ * hint in the slot of its expiry tick, and the reaper only looks up the
+ * keys hinted in the slots that came due. A hint whose tick no longer
+ * matches the node was superseded by a later write (which left its own
+ * hint) and is dropped; one that is due early because its expiry lies
+ * beyond the wheel is put back. No timer is armed per entry.
+ */
+#define KV_TTL_TICK	(HZ / 10 ?: 1)
+#define KV_TTL_SLOTS	256
+#define KV_TTL_CHUNK	510
+
+struct kv_ttl_hint {
+	int key;
+	u32 tick;	/* low bits of the expiry tick the hint was made for */
+};
+
+struct kv_ttl_chunk {
+	struct kv_ttl_chunk *next;
+	unsigned int nr;
+	struct kv_ttl_hint hints[KV_TTL_CHUNK];
+};
+
+struct kv_ttl_wheel {
+	spinlock_t lock;
+	unsigned long next_tick;	/* first tick not reaped yet */
+	unsigned long armed_tick;	/* tick the reaper is queued for */
+	bool armed;
+	struct kv_ttl_chunk *slots[KV_TTL_SLOTS];
+};
+
+/*
+ * Per-CPU counters behind /proc/<pid>/kv_stats. The latency histograms
+ * count write_kv and read_kv calls by log2 of their duration in ns,
+ * slot i holding [2^i, 2^(i+1)); contended counts writers that found
+ * the bucket (or flat table) lock taken.
+ *
+ * Only the read_kv and write_kv system calls are counted, like the
+ * kv_read/kv_write tracepoints: the batch, TTL, atomic, blob, named
+ * namespace and io_uring paths leave reads, writes and the histograms
+ * alone, though their lock contention still shows in contended.
+ */
+#define KV_LAT_SLOTS 32
+
+struct kv_stats {
+	u64 reads;
+	u64 read_misses;
+	u64 writes;
+	u64 write_errors;
+	u64 contended;
+	u64 read_ns[KV_LAT_SLOTS];
+	u64 write_ns[KV_LAT_SLOTS];
+};
+
+struct kv_store {
+	refcount_t refs;
+	u32 seed;
+	int layout;		/* KV_LAYOUT_*, fixed once active */
+	bool active;		/* first table allocated */
+	struct mutex ctl_mutex;
+	struct mutex cow_mutex;	/* copies from the base, and freezing it */
+	bool inherit;		/* fork shares the store, KV_CTL_SET_INHERIT */
+	atomic_long_t nr_keys;	/* in the live tables, not in a base */
+	unsigned long limit;	/* max keys, 0 for none; KV_CTL_SET_LIMIT */
+	bool evict;		/* cache mode: evict instead of failing */
+	unsigned int clock_hand;	/* next bucket to sweep, under ctl_mutex */
+	struct kv_table __rcu *table;
+	struct kv_table __rcu *old_table;
+	spinlock_t flat_lock;	/* writer lock of the flat and ordered layouts */
+	struct kv_flat __rcu *flat;
+	struct kv_flat __rcu *old_flat;
+	struct rb_root ord_root;
+	seqcount_spinlock_t ord_seq;	/* inserts into ord_root */
+	struct kv_shared *shared;	/* user-mapped mirror, KV_CTL_MAP_SHARED */
+	struct kv_shared **replicas;	/* by node id, KV_CTL_SET_REPLICAS */
+	bool replicas_ready;	/* filled, kv_read may use them */
+	int node;		/* home node of tables and nodes, KV_CTL_SET_NODE */
+	struct work_struct resize_work;	/* runs under ctl_mutex */
+	struct work_struct free_work;	/* teardown after the last put */
+	atomic_t waiters;		/* tasks sleeping in kv_wait */
+	struct kv_ttl_wheel *ttl;	/* allocated by the first write_kv_ttl */
+	struct delayed_work ttl_work;	/* reaper, cancelled at teardown */
+	struct kv_stats __percpu *stats;
+	struct kv_blobs *blobs;		/* allocated by the first write_kv_blob */
+	struct xarray watches;		/* kv_watch by (u32)key, under ctl_mutex */
+};
+
+static inline struct kv_bucket *kv_table_bucket(struct kv_table *tbl,
+						u32 seed, int k) {
+	return &tbl->buckets[jhash_1word((u32)k, seed) & (tbl->size - 1)];
+}
+
+/* Caller holds rcu_read_lock(). True while k is still served by the base */
+static inline bool kv_cow_pending(struct kv_cow *cow, u32 seed, int k) {
+	unsigned long *copied;
+	bool pending;
+
+	if (likely(!cow))
+		return false;
+	copied = smp_load_acquire(&cow->copied);
+	pending = !copied || !test_bit(kv_table_bucket(cow->base, seed, k) -
+				       cow->base->buckets, copied);
+	smp_rmb(); // the bit before the copies it stands for
+	return pending;
+}
+
+static inline bool kv_cow_done(struct kv_cow *cow) {
+	return READ_ONCE(cow->nr_copied) == cow->base->size;
+}
+
+/* Caller holds rcu_read_lock(). The resize work can drop the base */
+static inline bool kv_cow_releasable(struct kv_cow *cow) {
+	return cow && (kv_cow_done(cow) || refcount_read(&cow->base->refs) == 1);
+}
+
+/*
+ * kv_wait sleeps on one of KV_WAIT_SIZE wait queues shared by all stores,
+ * picked by hashing (store, key); the wake function filters out waiters
+ * of other keys. A waiter queues itself and then reads the key under the
+ * key's lock, and writers check store->waiters under that same lock, so
+ * a change cannot slip in between without a wakeup and writers to stores
+ * nobody waits on pay one atomic read.
+ */
+#define KV_WAIT_BITS 8
+#define KV_WAIT_SIZE (1 << KV_WAIT_BITS)
+
+static struct wait_queue_head kv_waitq[KV_WAIT_SIZE];
+
+struct kv_waiter {
+	struct wait_queue_entry wq_entry;
+	struct kv_store *store;
+	int key;
+};
+
+static int __init kv_wait_init(void) {
+	for (int i = 0; i < KV_WAIT_SIZE; i++)
+		init_waitqueue_head(&kv_waitq[i]);
+	return 0;
+}
+core_initcall(kv_wait_init);
+
+static inline struct wait_queue_head *kv_waitq_of(struct kv_store *store,
+						  int k) {
+	return &kv_waitq[hash_long((unsigned long)store ^
+				   jhash_1word((u32)k, store->seed), KV_WAIT_BITS)];
+}
+
+static int kv_wake_function(struct wait_queue_entry *wq_entry,
+			    unsigned int mode, int sync, void *arg) {
+	struct kv_waiter *w = container_of(wq_entry, struct kv_waiter, wq_entry);
+	struct kv_waiter *key = arg;
+
+	if (w->store != key->store || w->key != key->key)
+		return 0;
+	return default_wake_function(wq_entry, mode, sync, NULL);
+}
+
+/* Caller holds the lock protecting k and has just changed it */
+static inline void kv_notify(struct kv_store *store, int k) {
+	if (unlikely(atomic_read(&store->waiters))) {
+		struct kv_waiter key = { .store = store, .key = k };
+		__wake_up(kv_waitq_of(store, k), TASK_NORMAL, 0, &key);
+	}
+}
+
+/*
+ * kv_watch registers eventfds to be signalled when a key changes. The
+ * watchers live in store->watches, an xarray indexed by key that only
+ * holds watched keys, and the node of a watched key carries ->watched,
+ * set under the key's lock by kv_watch and by the insert of the node.
+ * Writers test that bit and only look the key up when it is set.
+ * Watchers are freed after a grace period, as writers signal them under
+ * RCU. The flat layout has no node to carry the bit and cannot be
+ * watched.
+ */
+#define KV_WATCH_MAX	64	/* eventfds per key */
+
+struct kv_watcher {
+	struct hlist_node node;
+	struct eventfd_ctx *ctx;
+};
+
+struct kv_watch {
+	struct hlist_head head;	/* of kv_watcher, RCU */
+	unsigned int nr;
+	struct rcu_head rcu;
+};
+
+/* ->watched for a node about to be inserted under k's lock */
+static inline bool kv_watched(struct kv_store *store, int k) {
+	return unlikely(!xa_empty(&store->watches)) &&
+	       xa_load(&store->watches, (u32)k);
+}
+
+/* Caller holds the lock protecting k, whose node has ->watched set */
+static void kv_watch_signal(struct kv_store *store, int k) {
+	struct kv_watcher *wr;
+	struct kv_watch *w;
+
+	rcu_read_lock();
+	w = xa_load(&store->watches, (u32)k);
+	if (w)
+		hlist_for_each_entry_rcu(wr, &w->head, node)
+			eventfd_signal(wr->ctx, 1);
+	rcu_read_unlock();
+}
+
+static void kv_watch_free(struct kv_watch *w) {
+	struct kv_watcher *wr;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_safe(wr, n, &w->head, node) {
+		eventfd_ctx_put(wr->ctx);
+		kfree(wr);
+	}
+	kfree(w);
+}
+
+static void kv_watch_free_rcu(struct rcu_head *rcu) {
+	kv_watch_free(container_of(rcu, struct kv_watch, rcu));
+}
+
+/*
+ * Opt-in user-mapped mirror of the store, for read_kv without a syscall.
+ * It is a linear-probing table of kv_shared_slot that user space maps
+ * read-only and reads under a sequence counter, like the vDSO data page:
+ * the reader retries while kv_shared_hdr.seq is odd or has changed.
+ * Writers update it under the key's bucket lock (or flat_lock) right
+ * after the store itself, so the mirror never goes back in time for a
+ * key. Keys that do not fit set ->overflow, and a miss must then be
+ * confirmed with read_kv.
+ *
+ * User-visible layout, slot i of key k is probed from
+ * ((u32)k * KV_SHARED_MULT) >> (32 - log2(nslots)).
+ */
+#define KV_SHARED_MULT		0x9e3779b1U
+#define KV_SHARED_MIN_SLOTS	64
+#define KV_SHARED_MAX_SLOTS	(1U << 22)
+
+#define KV_SLOT_EMPTY	0
+#define KV_SLOT_FULL	1
+#define KV_SLOT_GONE	2	/* key removed, slot kept for probing */
+
+struct kv_shared_hdr {
+	u32 seq;
+	u32 nslots;
+	u32 used;
+	u32 overflow;
+};
+
+struct kv_shared_slot {
+	u32 state;
+	int key;
+	int value;
+};
+
+struct kv_shared {
+	refcount_t refs;	/* the store and every open fd */
+	spinlock_t lock;	/* serialises writers of hdr->seq */
+	unsigned int shift;
+	struct kv_shared_hdr *hdr;	/* vmalloc_user(), slots follow */
+	struct kv_shared_slot *slots;
+};
+
+static void put_kv_shared(struct kv_shared *sh) {
+	if (sh && refcount_dec_and_test(&sh->refs)) {
+		vfree(sh->hdr);
+		kfree(sh);
+	}
+}
+
+/* Mirror k -> v (state KV_SLOT_FULL) or its removal (KV_SLOT_GONE) */
+static void kv_shared_set(struct kv_shared *sh, int k, int v, u32 state) {
+	struct kv_shared_hdr *hdr = sh->hdr;
+	unsigned int mask = hdr->nslots - 1;
+	unsigned int i = ((u32)k * KV_SHARED_MULT) >> sh->shift;
+	struct kv_shared_slot *slot = NULL;
+
+	spin_lock(&sh->lock);
+	for (unsigned int n = 0; n < hdr->nslots; n++, i = (i + 1) & mask) {
+		if (sh->slots[i].state == KV_SLOT_EMPTY || sh->slots[i].key == k) {
+			slot = &sh->slots[i];
 			break;
 		}
 	}
-	if (find) {
-		spin_unlock(&bucket->lock);
-		return 0; // successful write
-	} else {
-		struct kv_node *new_node = kmalloc(sizeof(struct kv_node), GFP_KERNEL);
-		if (!new_node) {
-			spin_unlock(&bucket->lock);
-			return -1; // memory allocation failed
+	if (!slot || slot->state == KV_SLOT_EMPTY) {
+		if (state != KV_SLOT_FULL)
+			goto out;
+		if (!slot || hdr->used >= hdr->nslots / 4 * 3) {
+			WRITE_ONCE(hdr->overflow, 1);
+			goto out;
 		}
-		new_node->key = k;
-		new_node->value = v;
-		hlist_add_head(&new_node->node, &bucket->head);
-		spin_unlock(&bucket->lock);
-		return 0; // successful write
+		hdr->used++;
 	}
+
+	WRITE_ONCE(hdr->seq, hdr->seq + 1);
+	smp_wmb();
+	WRITE_ONCE(slot->key, k);
+	WRITE_ONCE(slot->value, v);
+	WRITE_ONCE(slot->state, state);
+	smp_wmb();
+	WRITE_ONCE(hdr->seq, hdr->seq + 1);
+out:
+	spin_unlock(&sh->lock);
 }
 
-SYSCALL_DEFINE1(read_kv, int, k) {
-	struct task_struct *p = current;
-	unsigned int hash = k % 1024;
-	int value = -1;
-	struct kv_bucket *bucket = p->kv_store[hash];
-	struct kv_node *entry;
-	spin_lock(&bucket->lock);
-	hlist_for_each_entry(entry, &bucket->head, node) {
-		if (entry->key == k) {
-			value = entry->value;
+/*
+ * Caller holds the lock protecting k in the store. Every change to a key
+ * goes through one of these two, which also wake its kv_wait sleepers.
+ */
+static void kv_replicate(struct kv_shared **rep, int k, int v, u32 state) {
+	int nid;
+
+	for_each_node(nid)
+		if (rep[nid])
+			kv_shared_set(rep[nid], k, v, state);
+}
+
+static inline void kv_mirror(struct kv_store *store, int k, int v) {
+	struct kv_shared *sh = READ_ONCE(store->shared);
+	struct kv_shared **rep = READ_ONCE(store->replicas);
+	if (unlikely(sh))
+		kv_shared_set(sh, k, v, KV_SLOT_FULL);
+	if (unlikely(rep))
+		kv_replicate(rep, k, v, KV_SLOT_FULL);
+	kv_notify(store, k);
+}
+
+static inline void kv_unmirror(struct kv_store *store, int k) {
+	struct kv_shared *sh = READ_ONCE(store->shared);
+	struct kv_shared **rep = READ_ONCE(store->replicas);
+	if (unlikely(sh))
+		kv_shared_set(sh, k, 0, KV_SLOT_GONE);
+	if (unlikely(rep))
+		kv_replicate(rep, k, 0, KV_SLOT_GONE);
+	kv_notify(store, k);
+}
+
+/*
+ * KV_CTL_SET_REPLICAS: read-mostly stores spanning several nodes keep a
+ * kernel-only copy of the mirror on every online node, updated by the
+ * writers with the user-mapped one, and read_kv probes the replica of
+ * the node it runs on instead of the table on the store's home node.
+ * Returns 1 on a hit, 0 on a miss and -1 if the replica overflowed and
+ * the miss has to be confirmed in the store.
+ */
+static int kv_replica_read(struct kv_shared *sh, int k, int *v) {
+	struct kv_shared_hdr *hdr = sh->hdr;
+	unsigned int mask = hdr->nslots - 1;
+	unsigned int seq;
+	int ret;
+
+	for (;;) {
+		unsigned int i = ((u32)k * KV_SHARED_MULT) >> sh->shift;
+
+		seq = smp_load_acquire(&hdr->seq);
+		if (seq & 1) {
+			cpu_relax();
+			continue;
+		}
+		ret = READ_ONCE(hdr->overflow) ? -1 : 0;
+		for (unsigned int n = 0; n < hdr->nslots; n++, i = (i + 1) & mask) {
+			struct kv_shared_slot *slot = &sh->slots[i];
+			u32 state = READ_ONCE(slot->state);
+
+			if (state == KV_SLOT_EMPTY)
+				break;
+			if (READ_ONCE(slot->key) != k)
+				continue;
+			/* A removed key keeps its slot, and gets it back */
+			if (state == KV_SLOT_FULL) {
+				*v = READ_ONCE(slot->value);
+				ret = 1;
+			} else {
+				ret = 0;
+			}
 			break;
 		}
+		smp_rmb();
+		if (READ_ONCE(hdr->seq) == seq)
+			return ret;
+	}
+}
+
+static int kv_shared_mmap(struct file *file, struct vm_area_struct *vma) {
+	struct kv_shared *sh = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, sh->hdr, vma->vm_pgoff);
+}
+
+static int kv_shared_release(struct inode *inode, struct file *file) {
+	put_kv_shared(file->private_data);
+	return 0;
+}
+
+static const struct file_operations kv_shared_fops = {
+	.mmap		= kv_shared_mmap,
+	.release	= kv_shared_release,
+	.llseek		= noop_llseek,
+};
+
+/* NUMA_NO_NODE for the user-mappable mirror, else a replica on @node */
+static struct kv_shared *kv_shared_alloc(unsigned int nslots, int node) {
+	size_t size = sizeof(struct kv_shared_hdr) +
+		      nslots * sizeof(struct kv_shared_slot);
+	struct kv_shared *sh = kzalloc_node(sizeof(*sh), GFP_KERNEL, node);
+
+	if (!sh)
+		return NULL;
+	if (node == NUMA_NO_NODE)
+		sh->hdr = vmalloc_user(size);
+	else
+		sh->hdr = vzalloc_node(size, node);
+	if (!sh->hdr) {
+		kfree(sh);
+		return NULL;
+	}
+	refcount_set(&sh->refs, 1);
+	spin_lock_init(&sh->lock);
+	sh->shift = 32 - ilog2(nslots);
+	sh->slots = (struct kv_shared_slot *)(sh->hdr + 1);
+	sh->hdr->nslots = nslots;
+	return sh;
+}
+
+static struct kv_table *kv_table_alloc(unsigned int size, int node) {
+	struct kv_table *tbl;
+
+	tbl = kvmalloc_node(struct_size(tbl, buckets, size), GFP_KERNEL_ACCOUNT,
+			    node);
+	if (!tbl)
+		return NULL;
+	tbl->size = size;
+	refcount_set(&tbl->refs, 1);
+	tbl->cow = NULL;
+	for (unsigned int i = 0; i < size; i++) {
+		struct kv_bucket *bucket = &tbl->buckets[i];
+		INIT_HLIST_HEAD(&bucket->head);
+		spin_lock_init(&bucket->lock);
+		seqcount_spinlock_init(&bucket->seq, &bucket->lock);
+		bucket->moved = false;
+		if (!(i % 4096))
+			cond_resched();
+	}
+	return tbl;
+}
+
+static void kv_node_free_rcu(struct rcu_head *rcu) {
+	kmem_cache_free(kv_node_cachep, container_of(rcu, struct kv_node, rcu));
+}
+
+/*
+ * Only called once the last reference is gone, when no reader can reach
+ * the nodes any more, so they go straight back to the cache without an
+ * RCU grace period, in bulk and with a chance to reschedule in between.
+ */
+#define KV_FREE_CHUNK 128
+
+static void kv_table_free_nodes(struct kv_table *tbl) {
+	void *chunk[KV_FREE_CHUNK];
+	struct kv_node *entry;
+	struct hlist_node *n;
+	unsigned int cnt = 0;
+
+	for (unsigned int i = 0; i < tbl->size; i++) {
+		hlist_for_each_entry_safe(entry, n, &tbl->buckets[i].head, node) {
+			chunk[cnt++] = entry;
+			if (cnt == KV_FREE_CHUNK) {
+				kmem_cache_free_bulk(kv_node_cachep, cnt, chunk);
+				cnt = 0;
+				cond_resched();
+			}
+		}
+		if (!(i % 4096))
+			cond_resched();
+	}
+	if (cnt)
+		kmem_cache_free_bulk(kv_node_cachep, cnt, chunk);
+}
+
+/* Only bases are shared; a live table has the single reference */
+static void kv_table_put(struct kv_table *tbl) {
+	if (!refcount_dec_and_test(&tbl->refs))
+		return;
+	kv_table_free_nodes(tbl);
+	kvfree(tbl);
+}
+
+static void kv_cow_free(struct kv_cow *cow) {
+	if (!cow)
+		return;
+	kv_table_put(cow->base);
+	bitmap_free(cow->copied);
+	kfree(cow);
+}
+
+static struct kv_flat *kv_flat_alloc(unsigned int ngroups, int node) {
+	struct kv_flat *ft;
+
+	ft = kvmalloc_node(struct_size(ft, groups, ngroups), GFP_KERNEL_ACCOUNT,
+			   node);
+	if (!ft)
+		return NULL;
+	ft->ngroups = ngroups;
+	ft->used = 0;
+	for (unsigned int i = 0; i < ngroups; i++) {
+		ft->groups[i].ctrl = KV_FLAT_LO * KV_FLAT_EMPTY;
+		if (!(i % 4096))
+			cond_resched();
+	}
+	return ft;
+}
+
+static void kv_resize_work(struct work_struct *work);
+static void kv_free_work(struct work_struct *work);
+static void kv_ttl_work(struct work_struct *work);
+static void kv_blobs_free(struct kv_blobs *blobs);
+
+static struct kv_store *kv_store_alloc(void) {
+	struct kv_store *store = kzalloc(sizeof(*store), GFP_KERNEL_ACCOUNT);
+
+	if (!store)
+		return NULL;
+	refcount_set(&store->refs, 1);
+	store->seed = get_random_u32();
+	store->layout = KV_LAYOUT_HASH;
+	store->node = NUMA_NO_NODE;
+	mutex_init(&store->ctl_mutex);
+	mutex_init(&store->cow_mutex);
+	spin_lock_init(&store->flat_lock);
+	xa_init(&store->watches);
+	seqcount_spinlock_init(&store->ord_seq, &store->flat_lock);
+	INIT_WORK(&store->resize_work, kv_resize_work);
+	INIT_WORK(&store->free_work, kv_free_work);
+	INIT_DELAYED_WORK(&store->ttl_work, kv_ttl_work);
+	return store;
+}
+
+struct kv_store *get_kv_store(struct kv_store *store) {
+	refcount_inc(&store->refs);
+	return store;
+}
+
+static void kv_free_work(struct work_struct *work) {
+	struct kv_store *store = container_of(work, struct kv_store, free_work);
+	struct kv_table *tbl, *old;
+
+	/* The reaper runs without a reference, wait for it to finish */
+	cancel_delayed_work_sync(&store->ttl_work);
+	if (store->ttl) {
+		for (unsigned int i = 0; i < KV_TTL_SLOTS; i++) {
+			struct kv_ttl_chunk *chunk, *next;
+			for (chunk = store->ttl->slots[i]; chunk; chunk = next) {
+				next = chunk->next;
+				kfree(chunk);
+			}
+		}
+		kfree(store->ttl);
+	}
+	tbl = rcu_dereference_protected(store->table, 1);
+	old = rcu_dereference_protected(store->old_table, 1);
+	if (old)
+		kv_table_put(old);
+	if (tbl) {
+		kv_cow_free(tbl->cow);
+		kv_table_put(tbl);
+	}
+	kvfree(rcu_dereference_protected(store->old_flat, 1));
+	kvfree(rcu_dereference_protected(store->flat, 1));
+	if (store->layout == KV_LAYOUT_ORDERED) {
+		struct kv_onode *pos, *n;
+		unsigned long freed = 0;
+
+		rbtree_postorder_for_each_entry_safe(pos, n, &store->ord_root, rb) {
+			kfree(pos);
+			if (!(++freed % 4096))
+				cond_resched();
+		}
+	}
+	put_kv_shared(store->shared);
+	if (store->replicas) {
+		int nid;
+
+		for_each_node(nid)
+			put_kv_shared(store->replicas[nid]);
+		kfree(store->replicas);
+	}
+	if (store->blobs)
+		kv_blobs_free(store->blobs);
+	if (!xa_empty(&store->watches)) {
+		struct kv_watch *w;
+		unsigned long key;
+
+		xa_for_each(&store->watches, key, w)
+			kv_watch_free(w);
+		xa_destroy(&store->watches);
+	}
+	free_percpu(store->stats);
+	kfree(store);
+}
+
+/*
+ * The resize work holds a reference while it is queued or running, so
+ * the last put never races with a resize. The last put usually comes
+ * from free_signal_struct, possibly in RCU callback context, and the
+ * store may hold millions of nodes, so the teardown is left to a worker
+ * and reaping the task does not depend on the size of the store.
+ */
+void put_kv_store(struct kv_store *store) {
+	if (!store || !refcount_dec_and_test(&store->refs))
+		return;
+	queue_work(system_unbound_wq, &store->free_work);
+}
+
+/* Store of the current thread group, NULL if nothing was written */
+static struct kv_store *kv_store_get(void) {
+	struct kv_store *store = smp_load_acquire(&current->signal->kv_store);
+	if (!store || !smp_load_acquire(&store->active))
+		return NULL;
+	return store;
+}
+
+/*
+ * Attach a store to the thread group on first use. Threads may race to
+ * do it; the first cmpxchg wins and the others free their copy. The
+ * signal_struct holds the only long-lived reference.
+ */
+static struct kv_store *kv_store_attach(void) {
+	struct signal_struct *sig = current->signal;
+	struct kv_store *store = smp_load_acquire(&sig->kv_store);
+
+	if (store)
+		return store;
+	store = kv_store_alloc();
+	if (!store)
+		return NULL;
+	// proc_pid_kv_stats() reads it without locks
+	if (cmpxchg(&sig->kv_store, NULL, store)) {
+		put_kv_store(store);
+		store = smp_load_acquire(&sig->kv_store);
+	}
+	return store;
+}
+
+/*
+ * Node the caller's memory policy would place its own allocations on,
+ * which is where the store's tables and nodes go unless KV_CTL_SET_NODE
+ * picked one.
+ */
+static int kv_home_node(void) {
+#ifdef CONFIG_NUMA
+	return mempolicy_slab_node();
+#else
+	return NUMA_NO_NODE;
+#endif
+}
+
+/*
+ * Allocate the counters and the first table in the selected layout;
+ * store->active is set. A store that is only configured (kv_ctl) or
+ * lost the attach race never pays for the per-CPU counters.
+ */
+static int kv_store_activate(struct kv_store *store) {
+	int ret = 0;
+
+	if (smp_load_acquire(&store->active))
+		return 0;
+
+	mutex_lock(&store->ctl_mutex);
+	if (!store->active) {
+		if (store->node == NUMA_NO_NODE)
+			WRITE_ONCE(store->node, kv_home_node());
+		if (!store->stats)
+			store->stats = alloc_percpu_gfp(struct kv_stats,
+							GFP_KERNEL_ACCOUNT);
+		if (!store->stats) {
+			ret = -ENOMEM;
+		} else if (store->layout == KV_LAYOUT_FLAT) {
+			struct kv_flat *ft = kv_flat_alloc(KV_FLAT_MIN_GROUPS,
+							   store->node);
+			if (ft)
+				rcu_assign_pointer(store->flat, ft);
+			else
+				ret = -ENOMEM;
+		} else if (store->layout == KV_LAYOUT_HASH) {
+			struct kv_table *tbl = kv_table_alloc(KV_MIN_BUCKETS,
+							      store->node);
+			if (tbl)
+				rcu_assign_pointer(store->table, tbl);
+			else
+				ret = -ENOMEM;
+		} // the ordered layout starts from an empty ord_root
+		if (!ret)
+			smp_store_release(&store->active, true);
+	}
+	mutex_unlock(&store->ctl_mutex);
+	return ret;
+}
+
+static struct kv_store *kv_store_get_or_alloc(void) {
+	struct kv_store *store = kv_store_attach();
+
+	if (!store || kv_store_activate(store))
+		return NULL;
+	return store;
+}
+
+/*
+ * Load the table pair. old_table is published before table, so once the
+ * new table is seen the old one is too, until it has been fully drained.
+ */
+static inline struct kv_table *kv_tables(struct kv_store *store,
+					 struct kv_table **old) {
+	struct kv_table *tbl = rcu_dereference(store->table);
+	smp_rmb();
+	*old = rcu_dereference(store->old_table);
+	return tbl;
+}
+
+/*
+ * Readers walk the chain under rcu_read_lock() only; writers hold
+ * bucket->lock and publish nodes with the _rcu hlist helpers.
+ */
+static struct kv_node *kv_find(struct kv_bucket *bucket, int k) {
+	struct kv_node *entry;
+	hlist_for_each_entry_rcu(entry, &bucket->head, node,
+				 lockdep_is_held(&bucket->lock)) {
+		if (entry->key == k)
+			return entry;
 	}
+	return NULL;
+}
+
+/* Lock-free walk of one bucket; *moved tells the caller to look elsewhere */
+static struct kv_node *kv_find_stable(struct kv_bucket *bucket, int k,
+				      bool *moved) {
+	struct kv_node *entry;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&bucket->seq);
+		*moved = READ_ONCE(bucket->moved);
+		entry = *moved ? NULL : kv_find(bucket, k);
+	} while (read_seqcount_retry(&bucket->seq, seq));
+	return entry;
+}
+
+/* Caller holds rcu_read_lock() */
+static struct kv_node *kv_lookup(struct kv_store *store, int k) {
+	struct kv_table *tbl, *old;
+	struct kv_node *entry;
+	struct kv_cow *cow;
+	bool moved, pending;
+
+retry:
+	tbl = kv_tables(store, &old);
+	cow = READ_ONCE(tbl->cow);
+	pending = kv_cow_pending(cow, store->seed, k);
+	if (old) {
+		entry = kv_find_stable(kv_table_bucket(old, store->seed, k), k, &moved);
+		if (entry)
+			return entry;
+	}
+	entry = kv_find_stable(kv_table_bucket(tbl, store->seed, k), k, &moved);
+	if (!entry && moved)
+		goto retry; // tbl itself is being drained by a newer resize
+	if (!entry && pending)
+		entry = kv_find(kv_table_bucket(cow->base, store->seed, k), k);
+	return entry;
+}
+
+static inline void kv_spin_lock(struct kv_store *store, spinlock_t *lock) {
+	if (unlikely(!spin_trylock(lock))) {
+		this_cpu_inc(store->stats->contended);
+		spin_lock(lock);
+	}
+}
+
+/*
+ * Lock the bucket that currently owns k. Returns with rcu_read_lock()
+ * and the bucket lock held; release both with kv_bucket_unlock().
+ */
+static struct kv_bucket *kv_bucket_lock(struct kv_store *store, int k) {
+	struct kv_table *tbl, *old;
+	struct kv_bucket *bucket;
+
+	rcu_read_lock();
+retry:
+	tbl = kv_tables(store, &old);
+	if (old) {
+		bucket = kv_table_bucket(old, store->seed, k);
+		kv_spin_lock(store, &bucket->lock);
+		if (!bucket->moved)
+			return bucket;
+		spin_unlock(&bucket->lock);
+	}
+	bucket = kv_table_bucket(tbl, store->seed, k);
+	kv_spin_lock(store, &bucket->lock);
+	if (likely(!bucket->moved))
+		return bucket;
 	spin_unlock(&bucket->lock);
-	return value;
+	goto retry;
+}
+
+static inline void kv_bucket_unlock(struct kv_bucket *bucket) {
+	spin_unlock(&bucket->lock);
+	rcu_read_unlock();
+}
+
+/*
+ * KV_CTL_SET_LIMIT caps the number of int keys; write_kv_blob keys live
+ * in their own table and are not counted. Without cache mode an insert
+ * that would go past it fails; with it the insert goes through and
+ * kv_evict() brings the store back under the limit. Only the count is
+ * capped: nodes and tables are charged to the memory cgroup as well.
+ */
+static inline bool kv_store_limited(struct kv_store *store) {
+	return READ_ONCE(store->limit) && !READ_ONCE(store->evict);
+}
+
+/* Caller holds flat_lock, which all inserts of the layout take */
+static inline bool kv_store_full(struct kv_store *store) {
+	return kv_store_limited(store) &&
+	       atomic_long_read(&store->nr_keys) >= READ_ONCE(store->limit);
+}
+
+/*
+ * The chained layout inserts under different bucket locks, so a check
+ * like kv_store_full() would let racing inserts past the limit. Count
+ * the insert in nr_keys first and take it back if that went over; the
+ * caller does the same if it ends up not inserting.
+ */
+static inline bool kv_store_reserve(struct kv_store *store) {
+	unsigned long nr = atomic_long_inc_return(&store->nr_keys);
+
+	if (kv_store_limited(store) && nr > READ_ONCE(store->limit)) {
+		atomic_long_dec(&store->nr_keys);
+		return false;
+	}
+	return true;
+}
+
+static inline bool kv_store_over(struct kv_store *store) {
+	unsigned long limit = READ_ONCE(store->limit);
+	return limit && atomic_long_read(&store->nr_keys) > limit;
+}
+
+/* Over by more than kv_evict() lets a store drift, see there */
+static inline bool kv_store_far_over(struct kv_store *store) {
+	unsigned long limit = READ_ONCE(store->limit);
+	return limit && atomic_long_read(&store->nr_keys) > limit + limit / 16;
+}
+
+static inline bool kv_expired(struct kv_node *entry) {
+	unsigned long expires = READ_ONCE(entry->expires);
+	return expires && time_after_eq(jiffies, expires);
+}
+
+static inline u64 kv_flat_match(u64 ctrl, u8 h2) {
+	u64 x = ctrl ^ (KV_FLAT_LO * h2);
+	return (x - KV_FLAT_LO) & ~x & KV_FLAT_HI;
+}
+
+/* Lock-free lookup in one flat table, returns the value slot or NULL */
+/* *probes is set to the number of groups looked at */
+static __always_inline int *__kv_flat_find(struct kv_flat *ft, u32 seed, int k,
+					   unsigned int *probes) {
+	u32 h = jhash_1word((u32)k, seed);
+	unsigned int mask = ft->ngroups - 1, g = (h >> 7) & mask;
+
+	/* Triangular probing visits every group of a power-of-two table */
+	for (unsigned int step = 1; step <= ft->ngroups; step++) {
+		struct kv_flat_group *grp = &ft->groups[g];
+		u64 ctrl = smp_load_acquire(&grp->ctrl);
+
+		*probes = step;
+		for (u64 m = kv_flat_match(ctrl, h & 0x7f); m; m &= m - 1) {
+			unsigned int j = __ffs64(m) / 8;
+			if (grp->keys[j] == k)
+				return &grp->vals[j];
+		}
+		if (ctrl & KV_FLAT_HI)
+			return NULL; // an insert would have stopped at this group
+		g = (g + step) & mask;
+	}
+	return NULL;
+}
+
+static int *kv_flat_find(struct kv_flat *ft, u32 seed, int k) {
+	unsigned int probes;
+	return __kv_flat_find(ft, seed, k, &probes);
+}
+
+/*
+ * Caller holds flat_lock. Returns 1 on insert, 0 on update, -1 if more
+ * than 7/8 of the slots would be taken once @reserve pending copies land.
+ */
+static int kv_flat_insert(struct kv_flat *ft, u32 seed, int k, int v,
+			  unsigned int reserve) {
+	u32 h = jhash_1word((u32)k, seed);
+	unsigned int mask = ft->ngroups - 1, g = (h >> 7) & mask;
+	int *slot = kv_flat_find(ft, seed, k);
+
+	if (slot) {
+		WRITE_ONCE(*slot, v);
+		return 0;
+	}
+	if (ft->used + reserve >= ft->ngroups * KV_FLAT_GROUP / 8 * 7)
+		return -1;
+	for (unsigned int step = 1; ; step++) {
+		struct kv_flat_group *grp = &ft->groups[g];
+		u64 ctrl = grp->ctrl;
+
+		if (ctrl & KV_FLAT_HI) {
+			unsigned int j = __ffs64(ctrl & KV_FLAT_HI) / 8;
+			grp->keys[j] = k;
+			grp->vals[j] = v;
+			ctrl &= ~(0xffULL << (j * 8));
+			ctrl |= (u64)(h & 0x7f) << (j * 8);
+			smp_store_release(&grp->ctrl, ctrl);
+			ft->used++;
+			return 1;
+		}
+		g = (g + step) & mask;
+	}
+}
+
+/* Caller holds rcu_read_lock() */
+static int *kv_flat_lookup(struct kv_store *store, int k) {
+	struct kv_flat *ft = rcu_dereference(store->flat);
+	struct kv_flat *old;
+	int *slot;
+
+	smp_rmb();
+	old = rcu_dereference(store->old_flat);
+	slot = kv_flat_find(ft, store->seed, k);
+	if (!slot && old)
+		slot = kv_flat_find(old, store->seed, k);
+	return slot;
+}
+
+/*
+ * Caller holds flat_lock. New keys always go to the newest table, leaving
+ * room for everything the resize work may still copy from the old one.
+ * Returns 1 for an insert, 0 for an update, -ENOSPC at the key limit and
+ * -EAGAIN if the table is full and has to grow first, see kv_flat_grow.
+ */
+static int kv_flat_write(struct kv_store *store, int k, int v) {
+	struct kv_flat *ft = rcu_dereference_protected(store->flat,
+				lockdep_is_held(&store->flat_lock));
+	struct kv_flat *old = rcu_dereference_protected(store->old_flat,
+				lockdep_is_held(&store->flat_lock));
+	int ret;
+
+	if (kv_store_full(store) && !kv_flat_find(ft, store->seed, k) &&
+	    !(old && kv_flat_find(old, store->seed, k)))
+		return -ENOSPC;
+	ret = kv_flat_insert(ft, store->seed, k, v, old ? old->used : 0);
+	if (ret < 0)
+		return -EAGAIN;
+	if (ret > 0 && !(old && kv_flat_find(old, store->seed, k)))
+		atomic_long_inc(&store->nr_keys);
+	kv_mirror(store, k, v);
+	return ret;
+}
+
+/* Grow when three quarters of the slots are in use */
+static unsigned int kv_flat_resize_target(struct kv_flat *ft) {
+	if (ft->used > ft->ngroups * KV_FLAT_GROUP / 4 * 3 &&
+	    ft->ngroups < KV_FLAT_MAX_GROUPS)
+		return ft->ngroups * 2;
+	return ft->ngroups;
+}
+
+/* Caller holds ctl_mutex. Returns -ENOSPC at the maximum size */
+static int kv_flat_resize(struct kv_store *store) {
+	struct kv_flat *old, *ft;
+
+	spin_lock(&store->flat_lock);
+	old = rcu_dereference_protected(store->flat, 1);
+	if (kv_flat_resize_target(old) == old->ngroups) {
+		spin_unlock(&store->flat_lock);
+		return old->ngroups < KV_FLAT_MAX_GROUPS ? 0 : -ENOSPC;
+	}
+	spin_unlock(&store->flat_lock);
+
+	ft = kv_flat_alloc(old->ngroups * 2, READ_ONCE(store->node));
+	if (!ft)
+		return -ENOMEM;
+	spin_lock(&store->flat_lock);
+	rcu_assign_pointer(store->old_flat, old);
+	rcu_assign_pointer(store->flat, ft);
+	spin_unlock(&store->flat_lock);
+
+	/* old is frozen now; copy whatever was not overwritten meanwhile */
+	for (unsigned int i = 0; i < old->ngroups; i++) {
+		struct kv_flat_group *grp = &old->groups[i];
+		u64 full = ~grp->ctrl & KV_FLAT_HI;
+
+		spin_lock(&store->flat_lock);
+		for (; full; full &= full - 1) {
+			unsigned int j = __ffs64(full) / 8;
+			/* Cannot fail: writers left room for old->used copies */
+			if (!kv_flat_find(ft, store->seed, grp->keys[j]))
+				kv_flat_insert(ft, store->seed, grp->keys[j],
+					       READ_ONCE(grp->vals[j]), 0);
+		}
+		spin_unlock(&store->flat_lock);
+		cond_resched();
+	}
+	rcu_assign_pointer(store->old_flat, NULL);
+	kvfree_rcu(old, rcu);
+	return 0;
+}
+
+/*
+ * An insert found the flat table full. The resize work is queued at
+ * three quarters but may not have run yet (a tight loop of writes, a
+ * single CPU), so grow the table here, or wait for the resize in
+ * flight, rather than failing the write. Returns 0, or -ENOSPC if the
+ * table is at its maximum size and -ENOMEM if it cannot grow.
+ */
+static int kv_flat_grow(struct kv_store *store) {
+	int ret;
+
+	mutex_lock(&store->ctl_mutex);
+	ret = kv_flat_resize(store);
+	mutex_unlock(&store->ctl_mutex);
+	return ret;
+}
+
+/* First node with key >= k, NULL if none; *depth counts nodes visited */
+static struct kv_onode *kv_ord_lower(struct kv_store *store, int k,
+				     unsigned int *depth) {
+	struct rb_node *n = rcu_dereference_raw(store->ord_root.rb_node);
+	struct kv_onode *best = NULL;
+
+	*depth = 0;
+	while (n) {
+		struct kv_onode *e = rb_entry(n, struct kv_onode, rb);
+
+		++*depth;
+		if (READ_ONCE(e->key) >= k) {
+			best = e;
+			n = rcu_dereference_raw(n->rb_left);
+		} else {
+			n = rcu_dereference_raw(n->rb_right);
+		}
+	}
+	return best;
+}
+
+/* Caller holds rcu_read_lock() */
+static struct kv_onode *kv_ord_lookup(struct kv_store *store, int k) {
+	struct kv_onode *e;
+	unsigned int seq, depth;
+
+	do {
+		seq = read_seqcount_begin(&store->ord_seq);
+		e = kv_ord_lower(store, k, &depth);
+		if (e && e->key == k)
+			return e;
+	} while (read_seqcount_retry(&store->ord_seq, seq));
+	return NULL;
+}
+
+/* Caller holds flat_lock; *link and *parent are where k would go */
+static struct kv_onode *kv_ord_locate(struct kv_store *store, int k,
+				      struct rb_node ***link,
+				      struct rb_node **parent) {
+	struct rb_node **p = &store->ord_root.rb_node;
+
+	*parent = NULL;
+	while (*p) {
+		struct kv_onode *e = rb_entry(*p, struct kv_onode, rb);
+
+		if (k == e->key)
+			return e;
+		*parent = *p;
+		p = k < e->key ? &(*p)->rb_left : &(*p)->rb_right;
+	}
+	*link = p;
+	return NULL;
+}
+
+/*
+ * Copy up to max entries with lo <= key < hi into keys/vals, in key
+ * order, and return how many. Each chunk of KV_ORD_CHUNK entries is
+ * gathered without flat_lock and gathered again if an insert raced with
+ * it, so writers are never held up by a long range. Only a descent from
+ * the root is safe against a concurrent rebalance (rb_next follows
+ * parent pointers that a rotation rewrites), so every entry is found by
+ * its own kv_ord_lower() from the previous key + 1, O(log n) each.
+ */
+#define KV_ORD_CHUNK 256
+
+static unsigned int kv_ord_range(struct kv_store *store, s64 lo, s64 hi,
+				 int *keys, int *vals, unsigned int max) {
+	unsigned int n = 0;
+
+	while (n < max && lo < hi) {
+		unsigned int seq, depth, got, want = min_t(unsigned int, max - n, KV_ORD_CHUNK);
+		struct kv_onode *e;
+
+		rcu_read_lock();
+		do {
+			s64 next = lo;
+
+			seq = read_seqcount_begin(&store->ord_seq);
+			for (got = 0; got < want && next < hi; got++) {
+				e = kv_ord_lower(store, next, &depth);
+				if (!e || e->key >= hi)
+					break;
+				keys[n + got] = e->key;
+				vals[n + got] = READ_ONCE(e->value);
+				next = (s64)e->key + 1;
+			}
+		} while (read_seqcount_retry(&store->ord_seq, seq));
+		rcu_read_unlock();
+
+		n += got;
+		if (got < want)
+			break; // ran out of keys below hi
+		lo = (s64)keys[n - 1] + 1;
+		cond_resched();
+	}
+	return n;
+}
+
+/* Grow past one key per bucket, shrink below one key per eight buckets */
+static unsigned int kv_resize_target(struct kv_store *store, unsigned int size) {
+	unsigned long nr = atomic_long_read(&store->nr_keys);
+
+	if (nr > size && size < KV_MAX_BUCKETS)
+		return min_t(unsigned long, roundup_pow_of_two(nr) * 2, KV_MAX_BUCKETS);
+	if (nr < size / 8 && size > KV_MIN_BUCKETS)
+		return max_t(unsigned long, roundup_pow_of_two(nr + 1) * 2, KV_MIN_BUCKETS);
+	return size;
+}
+
+static void kv_maybe_resize(struct kv_store *store) {
+	bool need;
+
+	if (store->layout == KV_LAYOUT_ORDERED)
+		return; // an rbtree never needs resizing
+	rcu_read_lock();
+	if (store->layout == KV_LAYOUT_FLAT) {
+		struct kv_flat *ft = rcu_dereference(store->flat);
+		need = !rcu_access_pointer(store->old_flat) &&
+		       kv_flat_resize_target(ft) != ft->ngroups;
+	} else {
+		struct kv_table *tbl, *old;
+		tbl = kv_tables(store, &old);
+		need = !old && (kv_resize_target(store, tbl->size) != tbl->size ||
+				kv_cow_releasable(READ_ONCE(tbl->cow)));
+	}
+	rcu_read_unlock();
+	if (!need || work_pending(&store->resize_work))
+		return;
+	get_kv_store(store);
+	if (!queue_work(system_unbound_wq, &store->resize_work))
+		refcount_dec(&store->refs); // already queued, we are not the last ref
+}
+
+/* Move every node of old->buckets[i] to its bucket in tbl */
+static void kv_rehash_bucket(struct kv_store *store, struct kv_table *old,
+			     struct kv_table *tbl, unsigned int i) {
+	struct kv_bucket *bucket = &old->buckets[i];
+	struct kv_node *entry;
+	struct hlist_node *n;
+
+	spin_lock(&bucket->lock);
+	write_seqcount_begin(&bucket->seq);
+	hlist_for_each_entry_safe(entry, n, &bucket->head, node) {
+		struct kv_bucket *dst = kv_table_bucket(tbl, store->seed, entry->key);
+
+		spin_lock_nested(&dst->lock, SINGLE_DEPTH_NESTING);
+		hlist_del_rcu(&entry->node);
+		hlist_add_head_rcu(&entry->node, &dst->head);
+		spin_unlock(&dst->lock);
+	}
+	WRITE_ONCE(bucket->moved, true);
+	write_seqcount_end(&bucket->seq);
+	spin_unlock(&bucket->lock);
+}
+
+static void kv_table_resize(struct kv_store *store) {
+	struct kv_table *old = rcu_dereference_protected(store->table, 1);
+	struct kv_table *tbl;
+	unsigned int size = kv_resize_target(store, old->size);
+
+	if (size == old->size)
+		return;
+	tbl = kv_table_alloc(size, READ_ONCE(store->node));
+	if (!tbl)
+		return;
+	tbl->cow = old->cow;
+
+	rcu_assign_pointer(store->old_table, old);
+	rcu_assign_pointer(store->table, tbl);
+	for (unsigned int i = 0; i < old->size; i++) {
+		kv_rehash_bucket(store, old, tbl, i);
+		cond_resched();
+	}
+	rcu_assign_pointer(store->old_table, NULL);
+	kvfree_rcu(old, rcu);
+}
+
+static void kv_cow_release(struct kv_store *store);
+
+static void kv_resize_work(struct work_struct *work) {
+	struct kv_store *store = container_of(work, struct kv_store, resize_work);
+
+	mutex_lock(&store->ctl_mutex);
+	if (store->layout == KV_LAYOUT_FLAT) {
+		kv_flat_resize(store);
+	} else {
+		kv_cow_release(store);
+		kv_table_resize(store);
+	}
+	mutex_unlock(&store->ctl_mutex);
+	put_kv_store(store);
+}
+
+/*
+ * Nodes are allocated before taking bucket->lock. A write that turns out
+ * to be an update leaves its node unused; it is parked in a one-entry
+ * per-CPU slot so that the next insert on this CPU can reuse it instead
+ * of going back to the slab allocator. Nodes come from the store's home
+ * node, so a spare from another node is only reused by stores of that
+ * node. They are also charged to the memcg of the task that allocated
+ * them, so a spare is only reused by tasks of that memcg.
+ */
+static DEFINE_PER_CPU(struct kv_node *, kv_spare_node);
+
+static void kv_node_recycle(struct kv_node *node) {
+	if (this_cpu_cmpxchg(kv_spare_node, NULL, node))
+		kmem_cache_free(kv_node_cachep, node);
+}
+
+/* Whether an allocation by current would have been charged like @node */
+static bool kv_node_same_memcg(struct kv_node *node) {
+	struct mem_cgroup *memcg;
+	bool ret;
+
+	if (!memcg_kmem_enabled())
+		return true;
+	rcu_read_lock();
+	memcg = mem_cgroup_from_task(current);
+	if (mem_cgroup_is_root(memcg))
+		memcg = NULL;	/* root allocations are not charged */
+	ret = mem_cgroup_from_obj(node) == memcg;
+	rcu_read_unlock();
+	return ret;
+}
+
+static struct kv_node *kv_node_alloc(struct kv_store *store) {
+	struct kv_node *node = this_cpu_xchg(kv_spare_node, NULL);
+	int nid = READ_ONCE(store->node);
+
+	if (node && ((nid != NUMA_NO_NODE &&
+		      page_to_nid(virt_to_page(node)) != nid) ||
+		     !kv_node_same_memcg(node))) {
+		kv_node_recycle(node);
+		node = NULL;
+	}
+	if (!node)
+		node = kmem_cache_alloc_node(kv_node_cachep, GFP_KERNEL, nid);
+	return node;
+}
+
+/*
+ * The bulk allocator fills from the local node only, so stores homed
+ * elsewhere take their batch one node at a time. Returns 0 or -ENOMEM.
+ */
+static int kv_node_alloc_bulk(struct kv_store *store, unsigned int cnt,
+			      struct kv_node **nodes) {
+	int nid = READ_ONCE(store->node);
+	unsigned int i;
+
+	if (nid == NUMA_NO_NODE || nid == numa_mem_id())
+		return kmem_cache_alloc_bulk(kv_node_cachep, GFP_KERNEL, cnt,
+					     (void **)nodes) ? 0 : -ENOMEM;
+	for (i = 0; i < cnt; i++) {
+		nodes[i] = kmem_cache_alloc_node(kv_node_cachep, GFP_KERNEL, nid);
+		if (!nodes[i]) {
+			kmem_cache_free_bulk(kv_node_cachep, i, (void **)nodes);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Caller holds bucket->lock. Inserting a new key consumes *spare (and
+ * sets it to NULL), updating an existing key leaves it alone. Either way
+ * the key's expiry becomes @expires.
+ *
+ * The caller must also have checked, under that lock, that k is not
+ * kv_cow_pending in the live table, and must add an insert to nr_keys
+ * before dropping it; see kv_store_clone for why both matter.
+ */
+static void kv_bucket_write(struct kv_store *store, struct kv_bucket *bucket,
+			    int k, int v, unsigned long expires,
+			    struct kv_node **spare) {
+	struct kv_node *entry = kv_find(bucket, k);
+	if (entry) {
+		WRITE_ONCE(entry->value, v);
+		WRITE_ONCE(entry->expires, expires);
+	} else {
+		entry = *spare;
+		*spare = NULL;
+		entry->key = k;
+		entry->value = v;
+		entry->referenced = true;
+		entry->watched = kv_watched(store, k);
+		entry->expires = expires;
+		hlist_add_head_rcu(&entry->node, &bucket->head);
+	}
+	kv_mirror(store, k, v);
+	if (unlikely(entry->watched))
+		kv_watch_signal(store, k);
+}
+
+/* Caller holds the bucket lock of entry */
+static void kv_node_remove(struct kv_store *store, struct kv_node *entry) {
+	hlist_del_rcu(&entry->node);
+	kv_unmirror(store, entry->key);
+	if (unlikely(entry->watched))
+		kv_watch_signal(store, entry->key);
+	atomic_long_dec(&store->nr_keys);
+	call_rcu(&entry->rcu, kv_node_free_rcu);
+}
+
+/*
+ * Cache mode eviction, CLOCK over the buckets of the table: reads set
+ * node->referenced, the hand clears it and evicts nodes found without
+ * it. Holding ctl_mutex keeps resizes out, so there is no old table to
+ * sweep.
+ *
+ * One insert sweeps at most KV_EVICT_BATCH buckets and the hand carries
+ * on from there at the next one, so a write never pays for a whole pass
+ * over a table full of referenced nodes. The store may drift a little
+ * over its limit meanwhile, or while a resize holds the mutex; once it
+ * is a sixteenth over, inserts wait for the mutex and sweep until it is
+ * back within that margin.
+ */
+#define KV_EVICT_BATCH 64
+
+static void kv_evict(struct kv_store *store) {
+	struct kv_table *tbl;
+	unsigned int hand, swept = 0;
+
+	if (kv_store_far_over(store))
+		mutex_lock(&store->ctl_mutex);
+	else if (!mutex_trylock(&store->ctl_mutex))
+		return;
+	tbl = rcu_dereference_protected(store->table,
+					lockdep_is_held(&store->ctl_mutex));
+	hand = store->clock_hand;
+	/* Two sweeps clear every bit, so nobody escapes the second one */
+	while (kv_store_over(store) && swept < tbl->size * 2 &&
+	       (swept < KV_EVICT_BATCH || kv_store_far_over(store))) {
+		struct kv_bucket *bucket = &tbl->buckets[hand++ & (tbl->size - 1)];
+		struct kv_node *entry;
+		struct hlist_node *n;
+
+		spin_lock(&bucket->lock);
+		hlist_for_each_entry_safe(entry, n, &bucket->head, node) {
+			if (!kv_store_over(store))
+				break;
+			if (READ_ONCE(entry->referenced)) {
+				WRITE_ONCE(entry->referenced, false);
+				continue;
+			}
+			kv_node_remove(store, entry);
+		}
+		spin_unlock(&bucket->lock);
+		if (!(++swept % 1024))
+			cond_resched();
+	}
+	store->clock_hand = hand;
+	mutex_unlock(&store->ctl_mutex);
+}
+
+static struct kv_ttl_wheel *kv_ttl_wheel(struct kv_store *store) {
+	struct kv_ttl_wheel *wheel = smp_load_acquire(&store->ttl), *old;
+
+	if (wheel)
+		return wheel;
+	wheel = kzalloc(sizeof(*wheel), GFP_KERNEL_ACCOUNT);
+	if (!wheel)
+		return NULL;
+	spin_lock_init(&wheel->lock);
+	wheel->next_tick = jiffies / KV_TTL_TICK;
+	old = cmpxchg(&store->ttl, NULL, wheel);
+	if (old) {
+		kfree(wheel);
+		return old;
+	}
+	return wheel;
+}
+
+/* Caller holds wheel->lock; (re)queue the reaper if tick comes sooner */
+static void kv_ttl_arm(struct kv_store *store, struct kv_ttl_wheel *wheel,
+		       unsigned long tick) {
+	unsigned long at = tick * KV_TTL_TICK;
+
+	if (wheel->armed && !time_before(tick, wheel->armed_tick))
+		return;
+	wheel->armed = true;
+	wheel->armed_tick = tick;
+	mod_delayed_work(system_unbound_wq, &store->ttl_work,
+			 time_after(at, jiffies) ? at - jiffies : 0);
+}
+
+/*
+ * Leave a hint that k expires at @expires. Without memory for it the key
+ * is only reclaimed when a lookup or a later write trips over it.
+ */
+static void kv_ttl_hint(struct kv_store *store, int k, unsigned long expires) {
+	struct kv_ttl_wheel *wheel = kv_ttl_wheel(store);
+	unsigned long tick = DIV_ROUND_UP(expires, KV_TTL_TICK);
+	struct kv_ttl_chunk *chunk, *fresh = NULL;
+	struct kv_ttl_chunk **slot;
+
+	if (!wheel)
+		return;
+	spin_lock(&wheel->lock);
+	for (;;) {
+		slot = &wheel->slots[max(tick, wheel->next_tick) % KV_TTL_SLOTS];
+		chunk = *slot;
+		if (chunk && chunk->nr < KV_TTL_CHUNK)
+			break;
+		if (fresh) {
+			fresh->next = chunk;
+			fresh->nr = 0;
+			*slot = chunk = fresh;
+			fresh = NULL;
+			break;
+		}
+		spin_unlock(&wheel->lock);
+		fresh = kmalloc(sizeof(*fresh), GFP_KERNEL_ACCOUNT);
+		if (!fresh)
+			return;
+		spin_lock(&wheel->lock);
+	}
+	chunk->hints[chunk->nr].key = k;
+	chunk->hints[chunk->nr].tick = tick;
+	chunk->nr++;
+	kv_ttl_arm(store, wheel, max(tick, wheel->next_tick));
+	spin_unlock(&wheel->lock);
+	kfree(fresh);
+}
+
+/* Returns 1 if the key was reaped */
+static int kv_ttl_reap(struct kv_store *store, struct kv_ttl_hint *hint) {
+	struct kv_bucket *bucket = kv_bucket_lock(store, hint->key);
+	struct kv_node *entry = kv_find(bucket, hint->key);
+	unsigned long expires = entry ? entry->expires : 0;
+	int ret = 0;
+
+	if (expires && (u32)DIV_ROUND_UP(expires, KV_TTL_TICK) != hint->tick)
+		expires = 0; // superseded, the newer write has its own hint
+	if (expires && time_after_eq(jiffies, expires)) {
+		kv_node_remove(store, entry);
+		ret = 1;
+	}
+	kv_bucket_unlock(bucket);
+	if (expires && !ret)
+		kv_ttl_hint(store, hint->key, expires); // beyond the wheel
+	return ret;
+}
+
+static void kv_ttl_work(struct work_struct *work) {
+	struct kv_store *store = container_of(to_delayed_work(work),
+					      struct kv_store, ttl_work);
+	struct kv_ttl_wheel *wheel = store->ttl;
+	struct kv_ttl_chunk *todo = NULL, *chunk;
+	unsigned long now = jiffies / KV_TTL_TICK, t;
+	unsigned int reaped = 0;
+
+	/* Teardown has begun if the count is zero; it cancels us */
+	if (!refcount_inc_not_zero(&store->refs))
+		return;
+
+	spin_lock(&wheel->lock);
+	wheel->armed = false;
+	for (t = wheel->next_tick;
+	     !time_after(t, now) && t - wheel->next_tick < KV_TTL_SLOTS; t++) {
+		struct kv_ttl_chunk **slot = &wheel->slots[t % KV_TTL_SLOTS];
+		while ((chunk = *slot)) {
+			*slot = chunk->next;
+			chunk->next = todo;
+			todo = chunk;
+		}
+	}
+	wheel->next_tick = now + 1;
+	spin_unlock(&wheel->lock);
+
+	while ((chunk = todo)) {
+		todo = chunk->next;
+		for (unsigned int i = 0; i < chunk->nr; i++)
+			reaped += kv_ttl_reap(store, &chunk->hints[i]);
+		kfree(chunk);
+		cond_resched();
+	}
+
+	/* Sleep until the next slot with hints in it */
+	spin_lock(&wheel->lock);
+	for (t = wheel->next_tick; t - wheel->next_tick < KV_TTL_SLOTS; t++) {
+		if (wheel->slots[t % KV_TTL_SLOTS]) {
+			kv_ttl_arm(store, wheel, t);
+			break;
+		}
+	}
+	spin_unlock(&wheel->lock);
+
+	if (reaped)
+		kv_maybe_resize(store);
+	put_kv_store(store);
+}
+
+/* Unlink k if a lookup found it expired */
+static void kv_expire(struct kv_store *store, int k) {
+	struct kv_bucket *bucket = kv_bucket_lock(store, k);
+	struct kv_node *entry = kv_find(bucket, k);
+
+	if (entry && kv_expired(entry))
+		kv_node_remove(store, entry);
+	kv_bucket_unlock(bucket);
+}
+
+/* Caller holds cow_mutex. Copy bucket b of the base into the live table */
+static int kv_cow_fill(struct kv_store *store, struct kv_cow *cow,
+		       unsigned int b) {
+	struct kv_node *entry;
+	long n = 0;
+
+	if (test_bit(b, cow->copied))
+		return 0;
+	hlist_for_each_entry(entry, &cow->base->buckets[b].head, node) {
+		struct kv_bucket *bucket;
+		struct kv_node *node;
+
+		n++;
+		if (kv_expired(entry))
+			continue;
+		node = kv_node_alloc(store);
+		if (!node)
+			return -ENOMEM;
+		bucket = kv_bucket_lock(store, entry->key);
+		/* The copy itself: cow_mutex keeps freezes out until done */
+		kv_bucket_write(store, bucket, entry->key, entry->value,
+				entry->expires, &node);
+		if (!node)
+			atomic_long_inc(&store->nr_keys);
+		kv_bucket_unlock(bucket);
+		if (node)
+			kv_node_recycle(node);
+		if (entry->expires)
+			kv_ttl_hint(store, entry->key, entry->expires);
+	}
+	smp_mb__before_atomic();
+	set_bit(b, cow->copied);
+	WRITE_ONCE(cow->nr_copied, cow->nr_copied + 1);
+	/* The copies count in nr_keys now; kv_stats adds the rest */
+	WRITE_ONCE(cow->nr_keys, cow->nr_keys - n);
+	return 0;
+}
+
+/* Caller holds cow_mutex; the cow of the live tables, bitmap allocated */
+static struct kv_cow *kv_cow_prepare(struct kv_store *store, int *err) {
+	struct kv_cow *cow;
+	unsigned long *copied;
+
+	rcu_read_lock();
+	cow = rcu_dereference(store->table)->cow;
+	rcu_read_unlock();
+	*err = 0;
+	if (!cow || cow->copied)
+		return cow;
+	copied = bitmap_zalloc(cow->base->size, GFP_KERNEL_ACCOUNT);
+	if (!copied) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+	smp_store_release(&cow->copied, copied);
+	return cow;
+}
+
+/* Make k writable in the live table, copying its base bucket if needed */
+static int kv_cow_copy(struct kv_store *store, int k) {
+	struct kv_cow *cow;
+	bool pending, release;
+	int ret;
+
+	rcu_read_lock();
+	cow = READ_ONCE(rcu_dereference(store->table)->cow);
+	pending = kv_cow_pending(cow, store->seed, k);
+	release = !pending && unlikely(kv_cow_releasable(cow));
+	rcu_read_unlock();
+	if (likely(!pending)) {
+		if (release) // e.g. the child exited, take the base back
+			kv_maybe_resize(store);
+		return 0;
+	}
+
+	mutex_lock(&store->cow_mutex);
+	cow = kv_cow_prepare(store, &ret);
+	if (cow)
+		ret = kv_cow_fill(store, cow, kv_table_bucket(cow->base, store->seed, k) -
+						  cow->base->buckets);
+	mutex_unlock(&store->cow_mutex);
+	kv_maybe_resize(store);
+	return ret;
+}
+
+/* Copy everything left in the base, for operations that walk the table */
+static int kv_cow_copy_all(struct kv_store *store) {
+	unsigned int size;
+	int ret = 0;
+
+	rcu_read_lock();
+	size = rcu_dereference(store->table)->cow ?
+	       rcu_dereference(store->table)->cow->base->size : 0;
+	rcu_read_unlock();
+	for (unsigned int b = 0; b < size && !ret; b++) {
+		struct kv_cow *cow;
+
+		mutex_lock(&store->cow_mutex);
+		cow = kv_cow_prepare(store, &ret);
+		if (cow && cow->base->size == size)
+			ret = kv_cow_fill(store, cow, b);
+		mutex_unlock(&store->cow_mutex);
+		if (!(b % 64)) {
+			kv_maybe_resize(store);
+			cond_resched();
+		}
+	}
+	kv_maybe_resize(store);
+	return ret;
+}
+
+/*
+ * Caller holds ctl_mutex and cow_mutex, @cow is the cow of @tbl, the
+ * live table, and nobody else holds a reference to its base. Drop what
+ * the base has in the buckets that were copied, which only tbl serves,
+ * and publish the base as the new table with tbl as the old one, so that
+ * the caller can move the keys of tbl into it the way a resize does.
+ * Costs what was written since the fork, not the size of the base.
+ */
+static void kv_cow_adopt(struct kv_store *store, struct kv_table *tbl,
+			 struct kv_cow *cow) {
+	struct kv_table *base = cow->base;
+	unsigned int b;
+
+	if (cow->copied) {
+		for_each_set_bit(b, cow->copied, base->size) {
+			struct kv_node *entry;
+			struct hlist_node *n;
+
+			/* Readers that still saw b pending may be walking it */
+			hlist_for_each_entry_safe(entry, n, &base->buckets[b].head,
+						  node) {
+				hlist_del_rcu(&entry->node);
+				call_rcu(&entry->rcu, kv_node_free_rcu);
+			}
+			cond_resched();
+		}
+	}
+	atomic_long_add(cow->nr_keys, &store->nr_keys); // the uncopied rest
+	rcu_assign_pointer(store->old_table, tbl);
+	rcu_assign_pointer(store->table, base);
+}
+
+/*
+ * Caller holds ctl_mutex, so no resize is in flight. Let go of the base
+ * once everything in it has been copied, or take it back as the live
+ * table once no other store shares it.
+ */
+static void kv_cow_release(struct kv_store *store) {
+	struct kv_table *tbl;
+	struct kv_cow *cow;
+
+	mutex_lock(&store->cow_mutex);
+	tbl = rcu_dereference_protected(store->table,
+					lockdep_is_held(&store->ctl_mutex));
+	cow = tbl ? tbl->cow : NULL;
+	if (cow && kv_cow_done(cow)) {
+		WRITE_ONCE(tbl->cow, NULL);
+		mutex_unlock(&store->cow_mutex);
+		synchronize_rcu(); // lookups may still be in the base
+		kv_cow_free(cow);
+		return;
+	}
+	if (!cow || refcount_read(&cow->base->refs) != 1) {
+		mutex_unlock(&store->cow_mutex);
+		return;
+	}
+	kv_cow_adopt(store, tbl, cow);
+	mutex_unlock(&store->cow_mutex);
+
+	for (unsigned int i = 0; i < tbl->size; i++) {
+		kv_rehash_bucket(store, tbl, cow->base, i);
+		cond_resched();
+	}
+	rcu_assign_pointer(store->old_table, NULL);
+	synchronize_rcu(); // lookups that loaded tbl still read its cow
+	bitmap_free(cow->copied);
+	kfree(cow); // its reference to the base is the live table's now
+	kvfree(tbl);
+}
+
+/*
+ * A new store that shares the current contents of @parent, an active
+ * store of the chained layout, through a frozen base. Returns it or an
+ * ERR_PTR.
+ *
+ * Freezing takes no bucket lock. It swaps in a new, empty live table
+ * whose cow makes every key pending, so writers have to copy from the
+ * base first, and kv_cow_copy waits for cow_mutex, which we hold until
+ * the freeze is done. Writers that looked up the old table before the
+ * swap are dealt with by the protocol every kv_bucket_write caller
+ * follows:
+ *
+ *  - kv_bucket_lock() re-checks bucket->moved under the lock, so a
+ *    writer never writes into a bucket a resize has drained;
+ *  - with the lock held, the writer re-checks kv_cow_pending on
+ *    store->table and backs off if the key became pending, so after
+ *    the swap nobody writes a key into the new table without its base
+ *    bucket; a writer that checked before the swap writes into the old
+ *    table, which is the base now, and that write is ordered before
+ *    the fork;
+ *  - the writer adds its insert to nr_keys before dropping the lock,
+ *    which is inside its RCU read section.
+ *
+ * So once synchronize_rcu() returns after the swap, no write into the
+ * base is in flight and nr_keys counts exactly what the base holds.
+ */
+static struct kv_store *kv_store_clone(struct kv_store *parent) {
+	struct kv_table *tbl, *mine = NULL, *theirs;
+	struct kv_cow *cow, *stale = NULL;
+	struct kv_store *store;
+	int ret = -ENOMEM;
+
+	store = kv_store_alloc();
+	if (store)	/* active from the start, kv_store_activate is skipped */
+		store->stats = alloc_percpu_gfp(struct kv_stats,
+						GFP_KERNEL_ACCOUNT);
+	theirs = kv_table_alloc(KV_MIN_BUCKETS, READ_ONCE(parent->node));
+	mine = kv_table_alloc(KV_MIN_BUCKETS, READ_ONCE(parent->node));
+	if (!store || !store->stats || !theirs || !mine)
+		goto fail;
+	theirs->cow = kzalloc(sizeof(*cow), GFP_KERNEL_ACCOUNT);
+	mine->cow = kzalloc(sizeof(*cow), GFP_KERNEL_ACCOUNT);
+	if (!theirs->cow || !mine->cow)
+		goto fail;
+	/*
+	 * A parent that diverged from its base takes it back if nobody else
+	 * shares it any more (the previous snapshot was closed, the children
+	 * exited), which costs what it wrote since. Otherwise it finishes
+	 * copying the base first, without ctl_mutex so that its table can
+	 * grow meanwhile. Other threads may dirty it again before we lock;
+	 * copy until it is not.
+	 */
+	for (;;) {
+		mutex_lock(&parent->ctl_mutex);	/* no resize in flight */
+		kv_cow_release(parent);
+		mutex_lock(&parent->cow_mutex);
+		tbl = rcu_dereference_protected(parent->table,
+						lockdep_is_held(&parent->ctl_mutex));
+		cow = tbl->cow;
+		if (!cow || !cow->copied || kv_cow_done(cow))
+			break;
+		mutex_unlock(&parent->cow_mutex);
+		mutex_unlock(&parent->ctl_mutex);
+		ret = kv_cow_copy_all(parent);
+		if (!ret && fatal_signal_pending(current))
+			ret = -EINTR;
+		if (ret)
+			goto fail;
+	}
+	if (cow && !cow->copied) {
+		/* Nothing written since the last fork: share the same base */
+		refcount_inc(&cow->base->refs);
+		theirs->cow->base = cow->base;
+		theirs->cow->nr_keys = cow->nr_keys;
+	} else {
+		/* Freeze tbl, it is self-contained now */
+		stale = cow;
+		mine->cow->base = tbl;
+		refcount_inc(&tbl->refs);
+		theirs->cow->base = tbl;
+		rcu_assign_pointer(parent->table, mine);
+		/*
+		 * Writers that locked a bucket of tbl before the switch must
+		 * finish before anyone copies from it or counts it, and
+		 * readers may still look at the stale base. Without other
+		 * threads or references there are no such writers.
+		 */
+		if (stale || refcount_read(&parent->refs) > 1 ||
+		    !thread_group_empty(current))
+			synchronize_rcu();
+		/* Nothing can be inserted into mine before cow_mutex drops */
+		theirs->cow->nr_keys = atomic_long_xchg(&parent->nr_keys, 0);
+		mine->cow->nr_keys = theirs->cow->nr_keys;
+		mine = NULL;
+		if (stale)
+			tbl->cow = NULL;
+	}
+	mutex_unlock(&parent->cow_mutex);
+	mutex_unlock(&parent->ctl_mutex);
+	kv_cow_free(stale);
+
+	store->seed = parent->seed;
+	store->layout = parent->layout;
+	store->limit = READ_ONCE(parent->limit);
+	store->evict = READ_ONCE(parent->evict);
+	store->node = READ_ONCE(parent->node);	/* like the mempolicy */
+	rcu_assign_pointer(store->table, theirs);
+	store->active = true;
+	if (mine) {
+		kfree(mine->cow);
+		kvfree(mine);
+	}
+	return store;
+
+fail:
+	if (theirs) {
+		kfree(theirs->cow);
+		kvfree(theirs);
+	}
+	if (mine) {
+		kfree(mine->cow);
+		kvfree(mine);
+	}
+	if (store) {
+		free_percpu(store->stats);
+		kfree(store);
+	}
+	return ERR_PTR(ret);
+}
+
+/*
+ * Called by copy_process for a fork of a process whose store has
+ * KV_CTL_SET_INHERIT set. Returns the child's store, NULL if it should
+ * start empty, or an ERR_PTR.
+ */
+struct kv_store *kv_store_fork(struct kv_store *parent) {
+	struct kv_store *store;
+
+	if (!READ_ONCE(parent->inherit) || !smp_load_acquire(&parent->active))
+		return NULL;
+	store = kv_store_clone(parent);
+	if (!IS_ERR(store))
+		store->inherit = true;
+	return store;
+}
+
+/*
+ * Caller holds rcu_read_lock(). Returns 1 on a hit, 0 on a miss and -1
+ * if the key is still there but has expired.
+ */
+static int kv_read(struct kv_store *store, int k, int *v) {
+	/*
+	 * Replicas do not know about expiry, TTL stores skip them; nor do
+	 * they set node->referenced, so kv_ctl keeps them from cache mode.
+	 */
+	if (unlikely(smp_load_acquire(&store->replicas_ready)) &&
+	    !READ_ONCE(store->ttl)) {
+		struct kv_shared *sh = store->replicas[numa_node_id()];
+		int ret;
+
+		if (sh && (ret = kv_replica_read(sh, k, v)) >= 0)
+			return ret;
+	}
+	if (store->layout == KV_LAYOUT_ORDERED) {
+		struct kv_onode *entry = kv_ord_lookup(store, k);
+		if (!entry)
+			return 0;
+		*v = READ_ONCE(entry->value);
+		return 1;
+	} else if (store->layout == KV_LAYOUT_FLAT) {
+		int *slot = kv_flat_lookup(store, k);
+		if (!slot)
+			return 0;
+		*v = READ_ONCE(*slot);
+		return 1;
+	} else {
+		struct kv_node *entry = kv_lookup(store, k);
+		if (!entry)
+			return 0;
+		if (kv_expired(entry))
+			return -1;
+		*v = READ_ONCE(entry->value);
+		if (!READ_ONCE(entry->referenced)) // keep the line clean when set
+			WRITE_ONCE(entry->referenced, true);
+		return 1;
+	}
+}
+
+/*
+ * Single-key read-modify-write, done under the key's bucket lock (or the
+ * flat layout's writer lock) so that kv_cas and kv_fetch_add are atomic
+ * with respect to every other writer of the store. Returns 0, -ENOMEM, or
+ * -ENOSPC for an insert past the key limit or into a flat table that is
+ * at its maximum size. With ->nowait set, -EAGAIN instead of allocating,
+ * copying a base bucket or taking a mutex.
+ */
+#define KV_RMW_SET	0	/* value = arg1 */
+#define KV_RMW_CAS	1	/* if value == arg1 (-1 when absent): value = arg2 */
+#define KV_RMW_ADD	2	/* value += arg1, absent counts as 0 */
+
+struct kv_rmw {
+	int op;
+	int arg1, arg2;
+	unsigned long expires;	/* KV_RMW_SET only, 0 for no expiry */
+	bool nowait;	/* the caller must not sleep, see kv_store_try_write */
+	int old;	/* value seen before the operation */
+	bool done;	/* value was written */
+};
+
+static bool kv_rmw_apply(struct kv_rmw *rmw, bool found, int cur, int *v) {
+	switch (rmw->op) {
+	case KV_RMW_CAS:
+		rmw->old = found ? cur : -1;
+		if (rmw->old != rmw->arg1)
+			return false;
+		*v = rmw->arg2;
+		break;
+	case KV_RMW_ADD:
+		rmw->old = found ? cur : 0;
+		*v = (int)((u32)rmw->old + (u32)rmw->arg1); // wraps like atomic_add
+		break;
+	default:
+		rmw->old = found ? cur : -1;
+		*v = rmw->arg1;
+	}
+	rmw->done = true;
+	return true;
+}
+
+/*
+ * kv_rmw for the ordered layout. Updates of an existing key, the common
+ * case, allocate nothing; an insert allocates outside flat_lock first.
+ */
+static int kv_ord_rmw(struct kv_store *store, int k, struct kv_rmw *rmw) {
+	struct kv_onode *node = NULL, *entry;
+	struct rb_node **link, *parent;
+	int ret = 0, v;
+
+	rcu_read_lock();
+	entry = kv_ord_lookup(store, k);
+	rcu_read_unlock();
+	if (!entry) {
+		if (rmw->nowait)
+			return -EAGAIN;
+		node = kmalloc_node(sizeof(*node), GFP_KERNEL_ACCOUNT,
+				    READ_ONCE(store->node));
+		if (!node)
+			return -ENOMEM;
+	}
+	kv_spin_lock(store, &store->flat_lock);
+	/* Keys are never deleted, so a key seen above is still there */
+	entry = kv_ord_locate(store, k, &link, &parent);
+	if (!entry && kv_store_full(store)) {
+		ret = -ENOSPC; // key limit reached
+	} else if (kv_rmw_apply(rmw, entry, entry ? entry->value : 0, &v)) {
+		if (entry) {
+			WRITE_ONCE(entry->value, v);
+		} else {
+			node->key = k;
+			node->value = v;
+			node->watched = kv_watched(store, k);
+			write_seqcount_begin(&store->ord_seq);
+			rb_link_node_rcu(&node->rb, parent, link);
+			rb_insert_color(&node->rb, &store->ord_root);
+			write_seqcount_end(&store->ord_seq);
+			atomic_long_inc(&store->nr_keys);
+			entry = node;
+			node = NULL;
+		}
+		kv_mirror(store, k, v);
+		if (unlikely(entry->watched))
+			kv_watch_signal(store, k);
+	}
+	spin_unlock(&store->flat_lock);
+	kfree(node);
+	return ret;
+}
+
+static int kv_rmw(struct kv_store *store, int k, struct kv_rmw *rmw) {
+	struct kv_bucket *bucket;
+	struct kv_node *node, *entry;
+	bool found;
+	int ret = 0, v;
+
+	rmw->done = false;
+	if (store->layout == KV_LAYOUT_ORDERED)
+		return kv_ord_rmw(store, k, rmw);
+	if (store->layout == KV_LAYOUT_FLAT) {
+		int *slot;
+
+		do {
+			ret = 0;
+			kv_spin_lock(store, &store->flat_lock);
+			rcu_read_lock();
+			slot = kv_flat_lookup(store, k);
+			if (kv_rmw_apply(rmw, slot, slot ? *slot : 0, &v))
+				ret = kv_flat_write(store, k, v);
+			rcu_read_unlock();
+			spin_unlock(&store->flat_lock);
+		} while (ret == -EAGAIN && !rmw->nowait &&
+			 !(ret = kv_flat_grow(store)));
+		if (ret < 0) {
+			rmw->done = false;
+			return ret; // table full or key limit reached
+		}
+		if (ret)
+			kv_maybe_resize(store);
+		return 0;
+	}
+
+	/* Without a spare node only an existing key can be written */
+	node = rmw->nowait ? NULL : kv_node_alloc(store);
+	if (!node && !rmw->nowait)
+		return -ENOMEM;
+retry:
+	ret = rmw->nowait ? 0 : kv_cow_copy(store, k);
+	if (ret) {
+		kv_node_recycle(node);
+		return ret;
+	}
+	/*
+	 * kv_cow_copy ran before the lock; a fork may have frozen the table
+	 * since, and k must then be copied into the new one first.
+	 */
+	bucket = kv_bucket_lock(store, k);
+	if (unlikely(kv_cow_pending(rcu_dereference(store->table)->cow,
+				    store->seed, k))) {
+		kv_bucket_unlock(bucket); // frozen by a fork meanwhile
+		if (rmw->nowait)
+			return -EAGAIN;
+		goto retry;
+	}
+	entry = kv_find(bucket, k);
+	if (entry && kv_expired(entry))
+		found = false; // reuse the node, it still counts in nr_keys
+	else
+		found = entry;
+	if (!entry && rmw->nowait) {
+		ret = -EAGAIN; // an insert needs a node
+	} else if (!entry && !kv_store_reserve(store)) {
+		ret = -ENOSPC; // key limit reached
+	} else if (kv_rmw_apply(rmw, found, found ? entry->value : 0, &v)) {
+		/* kv_cas and kv_fetch_add keep the expiry of a live key */
+		if (rmw->op != KV_RMW_SET)
+			rmw->expires = found ? entry->expires : 0;
+		kv_bucket_write(store, bucket, k, v, rmw->expires, &node);
+	} else if (!entry) {
+		atomic_long_dec(&store->nr_keys); // kv_cas did not insert
+	}
+	kv_bucket_unlock(bucket);
+	if (rmw->done && rmw->expires && rmw->op == KV_RMW_SET)
+		kv_ttl_hint(store, k, rmw->expires);
+	if (node) {
+		kv_node_recycle(node);
+	} else if (!rmw->nowait) { // nothing was inserted otherwise
+		if (kv_store_over(store))
+			kv_evict(store);
+		kv_maybe_resize(store);
+	}
+	return ret;
+}
+
+static int kv_write(struct kv_store *store, int k, int v) {
+	struct kv_rmw rmw = { .op = KV_RMW_SET, .arg1 = v };
+	return kv_rmw(store, k, &rmw);
+}
+
+/*
+ * Bucket (home group for the flat layout) of k and the number of nodes
+ * (groups) walked to find it, for the kv_read/kv_write tracepoints. It
+ * is a second walk done only while one of them is enabled, and it looks
+ * at the newest table alone: during a resize or before a fork's base is
+ * copied the key may still be served from elsewhere. Caller holds
+ * rcu_read_lock(). Returns true if k was found.
+ */
+static bool kv_trace_probe(struct kv_store *store, int k, int *bucket,
+			   unsigned int *chain) {
+	if (store->layout == KV_LAYOUT_ORDERED) {
+		struct kv_onode *e = kv_ord_lower(store, k, chain);
+
+		*bucket = -1; // chain is the depth of the descent
+		return e && e->key == k;
+	} else if (store->layout == KV_LAYOUT_FLAT) {
+		struct kv_flat *ft = rcu_dereference(store->flat);
+
+		*bucket = (jhash_1word((u32)k, store->seed) >> 7) & (ft->ngroups - 1);
+		return __kv_flat_find(ft, store->seed, k, chain);
+	} else {
+		struct kv_table *tbl = rcu_dereference(store->table);
+		struct kv_bucket *b = kv_table_bucket(tbl, store->seed, k);
+		struct kv_node *entry;
+
+		*bucket = b - tbl->buckets;
+		*chain = 0;
+		hlist_for_each_entry_rcu(entry, &b->head, node) {
+			++*chain;
+			if (entry->key == k)
+				return true;
+		}
+		return false;
+	}
+}
+
+static inline unsigned int kv_lat_slot(u64 start) {
+	u64 ns = local_clock() - start;
+	return min_t(unsigned int, ilog2(ns | 1), KV_LAT_SLOTS - 1);
+}
+
+SYSCALL_DEFINE2(write_kv, int, k, int, v) {
+	struct kv_store *store = kv_store_get_or_alloc();
+	u64 start = local_clock();
+	int ret;
+	if (!store)
+		return -ENOMEM;
+	if (trace_kv_write_enabled()) {
+		unsigned int chain;
+		bool hit;
+		int bucket;
+
+		rcu_read_lock();
+		hit = kv_trace_probe(store, k, &bucket, &chain);
+		rcu_read_unlock();
+		trace_kv_write(k, bucket, chain, hit);
+	}
+	ret = kv_write(store, k, v);
+	this_cpu_inc(store->stats->writes);
+	if (ret)
+		this_cpu_inc(store->stats->write_errors);
+	this_cpu_inc(store->stats->write_ns[kv_lat_slot(start)]);
+	return ret;
+}
+
+SYSCALL_DEFINE1(read_kv, int, k) {
+	struct kv_store *store = kv_store_get();
+	u64 start = local_clock();
+	int value = -1, ret;
+	if (!store)
+		return value; // nothing written yet
+	rcu_read_lock();
+	ret = kv_read(store, k, &value);
+	if (trace_kv_read_enabled()) {
+		unsigned int chain;
+		int bucket;
+
+		kv_trace_probe(store, k, &bucket, &chain);
+		trace_kv_read(k, bucket, chain, ret > 0);
+	}
+	rcu_read_unlock();
+	if (ret < 0)
+		kv_expire(store, k);
+	this_cpu_inc(store->stats->reads);
+	if (ret <= 0)
+		this_cpu_inc(store->stats->read_misses);
+	this_cpu_inc(store->stats->read_ns[kv_lat_slot(start)]);
+	return value;
+}
+
+/*
+ * Entry points for IORING_OP_KV_READ and IORING_OP_KV_WRITE. The request
+ * takes a reference to the submitter's store when it is prepared, in the
+ * submitter's context, and drops it with put_kv_store() when it is done,
+ * so the op works on that store even when an io-wq worker issues it.
+ * Returns NULL if the store is needed but cannot be allocated, or if
+ * @alloc is false and nothing was ever written.
+ */
+struct kv_store *kv_store_get_current(bool alloc) {
+	struct kv_store *store = alloc ? kv_store_get_or_alloc() : kv_store_get();
+	return store ? get_kv_store(store) : NULL;
+}
+
+/* Returns 0, -ENOMEM, or -ENOSPC at the key limit as kv_rmw does */
+long kv_store_write(struct kv_store *store, int k, int v) {
+	return kv_write(store, k, v);
+}
+
+/*
+ * kv_store_write for a caller that must not sleep, such as an io_uring
+ * issue under IO_URING_F_NONBLOCK. Updates, and inserts into a flat table
+ * with room, are done in place; -EAGAIN if the write would allocate a
+ * node, copy a bucket out of a fork's base or grow the flat table.
+ */
+long kv_store_try_write(struct kv_store *store, int k, int v) {
+	struct kv_rmw rmw = { .op = KV_RMW_SET, .arg1 = v, .nowait = true };
+	return kv_rmw(store, k, &rmw);
+}
+
+/* Returns 0 and stores the value in *v, or -ENOENT if k is absent */
+long kv_store_read(struct kv_store *store, int k, int *v) {
+	int ret;
+
+	rcu_read_lock();
+	ret = kv_read(store, k, v);
+	rcu_read_unlock();
+	if (ret < 0)
+		kv_expire(store, k);
+	return ret > 0 ? 0 : -ENOENT;
+}
+
+/*
+ * write_kv whose key disappears @ms milliseconds later, unless it is
+ * written again first. Only the chained layout can drop keys. Returns 0,
+ * -EINVAL for @ms == 0, -EOPNOTSUPP for the other layouts, -ENOMEM, or
+ * -ENOSPC at the key limit.
+ */
+SYSCALL_DEFINE3(write_kv_ttl, int, k, int, v, unsigned int, ms) {
+	struct kv_rmw rmw = { .op = KV_RMW_SET, .arg1 = v };
+	struct kv_store *store;
+
+	if (!ms)
+		return -EINVAL;
+	store = kv_store_get_or_alloc();
+	if (!store)
+		return -ENOMEM;
+	// the layout is fixed once the store is active
+	if (store->layout != KV_LAYOUT_HASH)
+		return -EOPNOTSUPP;
+	rmw.expires = jiffies + msecs_to_jiffies(ms) ?: 1;
+	return kv_rmw(store, k, &rmw);
+}
+
+/*
+ * kv_cas returns 1 if the value was replaced and 0 if it did not match;
+ * an absent key matches expected == -1, the value read_kv reports for it.
+ * Inserting an absent key can fail with -ENOMEM or -ENOSPC.
+ */
+SYSCALL_DEFINE3(kv_cas, int, k, int, expected, int, new) {
+	struct kv_store *store = kv_store_get_or_alloc();
+	struct kv_rmw rmw = { .op = KV_RMW_CAS, .arg1 = expected, .arg2 = new };
+	int ret;
+
+	if (!store)
+		return -ENOMEM;
+	ret = kv_rmw(store, k, &rmw);
+	return ret ?: rmw.done;
+}
+
+/*
+ * Returns 0 and stores the value before the addition in *old, unless old
+ * is NULL; an absent key starts at 0. Inserting it can fail with -ENOMEM
+ * or -ENOSPC. -EFAULT means the addition was done but *old could not be
+ * written.
+ */
+SYSCALL_DEFINE3(kv_fetch_add, int, k, int, delta, int __user *, old) {
+	struct kv_store *store = kv_store_get_or_alloc();
+	struct kv_rmw rmw = { .op = KV_RMW_ADD, .arg1 = delta };
+	int ret;
+
+	if (!store)
+		return -ENOMEM;
+	ret = kv_rmw(store, k, &rmw);
+	if (ret)
+		return ret;
+	if (old && put_user(rmw.old, old))
+		return -EFAULT;
+	return 0;
+}
+
+/* Value of k as read_kv would report it, read under the key's lock */
+static int kv_read_locked(struct kv_store *store, int k) {
+	int v = -1;
+
+	if (!smp_load_acquire(&store->active))
+		return v; // nothing written yet, see kv_wait
+
+	if (store->layout != KV_LAYOUT_HASH) {
+		spin_lock(&store->flat_lock);
+		rcu_read_lock();
+		kv_read(store, k, &v);
+		rcu_read_unlock();
+		spin_unlock(&store->flat_lock);
+	} else {
+		struct kv_bucket *bucket = kv_bucket_lock(store, k);
+		struct kv_node *entry = kv_find(bucket, k);
+		struct kv_cow *cow = rcu_dereference(store->table)->cow;
+
+		if (!entry && kv_cow_pending(cow, store->seed, k))
+			entry = kv_find(kv_table_bucket(cow->base, store->seed, k), k);
+		if (entry && !kv_expired(entry))
+			v = entry->value;
+		kv_bucket_unlock(bucket);
+	}
+	return v;
+}
+
+/*
+ * Sleep until k holds something other than @expected (-1 for absent),
+ * like FUTEX_WAIT. Returns 0 once it does, -ETIMEDOUT after @timeout_ms
+ * (0 waits forever) and -EINTR on a signal.
+ *
+ * Waiting does not activate the store, which would fix its layout
+ * before the first write_kv. A store that is not active yet holds no
+ * keys; its first write activates it under ctl_mutex, so passing
+ * through ctl_mutex once store->waiters is raised means that write
+ * either is seen by kv_read_locked below or sees the waiter.
+ */
+SYSCALL_DEFINE3(kv_wait, int, k, int, expected, unsigned int, timeout_ms) {
+	struct kv_store *store = kv_store_attach();
+	long timeout = timeout_ms ? msecs_to_jiffies(timeout_ms) :
+				    MAX_SCHEDULE_TIMEOUT;
+	struct kv_waiter w = { .store = store, .key = k };
+	struct wait_queue_head *wq;
+	int ret;
+
+	if (!store)
+		return -ENOMEM;
+	wq = kv_waitq_of(store, k);
+	init_wait_func(&w.wq_entry, kv_wake_function);
+	atomic_inc(&store->waiters);
+	if (!smp_load_acquire(&store->active)) {
+		mutex_lock(&store->ctl_mutex);
+		mutex_unlock(&store->ctl_mutex);
+	}
+	for (;;) {
+		prepare_to_wait(wq, &w.wq_entry, TASK_INTERRUPTIBLE);
+		if (kv_read_locked(store, k) != expected) {
+			ret = 0;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		if (!timeout) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+		timeout = schedule_timeout(timeout);
+	}
+	finish_wait(wq, &w.wq_entry);
+	atomic_dec(&store->waiters);
+	return ret;
+}
+
+/*
+ * Set or clear ->watched on the node of k, if it is in the live store.
+ * Caller holds ctl_mutex, so an inactive store stays empty until after
+ * the watch is in the xarray and its first insert sees kv_watched().
+ */
+static void kv_watch_mark(struct kv_store *store, int k, bool on) {
+	if (!store->active)
+		return;
+	if (store->layout == KV_LAYOUT_ORDERED) {
+		struct rb_node **link, *parent;
+		struct kv_onode *entry;
+
+		spin_lock(&store->flat_lock);
+		entry = kv_ord_locate(store, k, &link, &parent);
+		if (entry)
+			entry->watched = on;
+		spin_unlock(&store->flat_lock);
+	} else {
+		/* A key still in a fork's base gets the bit when it is copied */
+		struct kv_bucket *bucket = kv_bucket_lock(store, k);
+		struct kv_node *entry = kv_find(bucket, k);
+
+		if (entry)
+			entry->watched = on;
+		kv_bucket_unlock(bucket);
+	}
+}
+
+/* Caller holds ctl_mutex */
+static int kv_watch_add(struct kv_store *store, int k,
+			struct eventfd_ctx *ctx) {
+	struct kv_watch *w = xa_load(&store->watches, (u32)k);
+	struct kv_watcher *wr;
+	int ret;
+
+	if (w) {
+		hlist_for_each_entry(wr, &w->head, node)
+			if (wr->ctx == ctx)
+				return -EEXIST;
+		if (w->nr >= KV_WATCH_MAX)
+			return -ENOSPC;
+	}
+	wr = kmalloc(sizeof(*wr), GFP_KERNEL_ACCOUNT);
+	if (!wr)
+		return -ENOMEM;
+	wr->ctx = ctx;
+	if (w) {
+		hlist_add_head_rcu(&wr->node, &w->head);
+		w->nr++;
+		return 0;
+	}
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL_ACCOUNT);
+	if (!w) {
+		kfree(wr);
+		return -ENOMEM;
+	}
+	hlist_add_head(&wr->node, &w->head);
+	w->nr = 1;
+	ret = xa_err(xa_store(&store->watches, (u32)k, w, GFP_KERNEL_ACCOUNT));
+	if (ret) {
+		kfree(wr);
+		kfree(w);
+		return ret;
+	}
+	/* An insert that takes k's lock after this finds w in the xarray */
+	kv_watch_mark(store, k, true);
+	return 0;
+}
+
+/* Caller holds ctl_mutex */
+static int kv_watch_clear(struct kv_store *store, int k) {
+	struct kv_watch *w = xa_erase(&store->watches, (u32)k);
+
+	if (!w)
+		return -ENOENT;
+	kv_watch_mark(store, k, false);
+	call_rcu(&w->rcu, kv_watch_free_rcu);
+	return 0;
+}
+
+/*
+ * Signal @efd, an eventfd, every time k is written or removed, whether
+ * or not its value changed, until kv_watch(k, -1) drops every watch of
+ * k. The eventfd counter says how many changes there were since it was
+ * last read, not which; re-read the key. Watches belong to the store
+ * and are not inherited by forks or snapshots.
+ */
+SYSCALL_DEFINE2(kv_watch, int, k, int, efd) {
+	/* Watching does not activate the store; the first write does */
+	struct kv_store *store = kv_store_attach();
+	struct eventfd_ctx *ctx = NULL;
+	long ret;
+
+	if (!store)
+		return -ENOMEM;
+	if (efd >= 0) {
+		ctx = eventfd_ctx_fdget(efd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+	mutex_lock(&store->ctl_mutex);
+	if (store->layout == KV_LAYOUT_FLAT)
+		ret = -EOPNOTSUPP;
+	else if (ctx)
+		ret = kv_watch_add(store, k, ctx);
+	else
+		ret = kv_watch_clear(store, k);
+	mutex_unlock(&store->ctl_mutex);
+	if (ret && ctx)
+		eventfd_ctx_put(ctx);
+	return ret;
+}
+
+/*
+ * Batched write_kv/read_kv: keys are copied in chunks of KV_BATCH_CHUNK.
+ * Writes are sorted by bucket, so every bucket lock is taken once per run
+ * of keys that hash to it. Ties are ordered by position, so a key repeated
+ * inside one batch ends up with its last value, as with a loop of write_kv
+ * calls. While a resize is in flight, writes fall back to one lock per key.
+ * Reads need no lock and are served in order under RCU.
+ */
+#define KV_BATCH_CHUNK 256
+
+struct kv_batch_ent {
+	unsigned int hash;
+	unsigned int idx;
+};
+
+struct kv_batch_buf {
+	int keys[KV_BATCH_CHUNK];
+	int vals[KV_BATCH_CHUNK];
+	struct kv_batch_ent ents[KV_BATCH_CHUNK];
+	struct kv_node *nodes[KV_BATCH_CHUNK];
+};
+
+static int kv_batch_cmp(const void *a, const void *b) {
+	const struct kv_batch_ent *x = a, *y = b;
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+static void kv_batch_sort(struct kv_batch_buf *buf, unsigned int cnt,
+			  struct kv_store *store, struct kv_table *tbl) {
+	for (unsigned int i = 0; i < cnt; i++) {
+		buf->ents[i].hash = kv_table_bucket(tbl, store->seed, buf->keys[i]) -
+				    tbl->buckets;
+		buf->ents[i].idx = i;
+	}
+	sort(buf->ents, cnt, sizeof(struct kv_batch_ent), kv_batch_cmp, NULL);
+}
+
+static bool kv_store_cow(struct kv_store *store) {
+	bool ret;
+
+	rcu_read_lock();
+	ret = rcu_dereference(store->table)->cow;
+	rcu_read_unlock();
+	return ret;
+}
+
+/* The flat layout has a single writer lock, taken once per chunk */
+static int kv_flat_write_batch(struct kv_store *store, struct kv_batch_buf *buf,
+			       unsigned int cnt) {
+	int inserted = 0, ret = 0;
+	unsigned int i = 0;
+
+	while (i < cnt) {
+		spin_lock(&store->flat_lock);
+		for (; i < cnt; i++) {
+			ret = kv_flat_write(store, buf->keys[i], buf->vals[i]);
+			if (ret < 0)
+				break;
+			inserted += ret;
+		}
+		spin_unlock(&store->flat_lock);
+		if (i == cnt) {
+			ret = 0;
+		} else if (ret != -EAGAIN || (ret = kv_flat_grow(store))) {
+			break;
+		}
+	}
+	if (inserted)
+		kv_maybe_resize(store);
+	return ret;
+}
+
+/*
+ * Caller holds the lock of k's bucket. True if k has to go through
+ * kv_rmw instead: its base bucket was not copied yet, because a fork
+ * froze the table after kv_batch_write looked or before it locked.
+ * This is the re-check kv_store_clone relies on.
+ */
+static inline bool kv_batch_defer(struct kv_store *store, int k) {
+	return unlikely(kv_cow_pending(READ_ONCE(rcu_dereference(store->table)->cow),
+				       store->seed, k));
+}
+
+/*
+ * Write one chunk of keys and values already in buf. Returns 0 or an
+ * error, with *done advanced by the entries written either way.
+ */
+static int kv_batch_write(struct kv_store *store, struct kv_batch_buf *buf,
+			  unsigned int cnt, unsigned int *done) {
+	unsigned int i = 0, used = 0, deferred = 0;
+	struct kv_table *tbl, *old;
+	int ret = 0;
+
+	if (store->layout == KV_LAYOUT_FLAT) {
+		ret = kv_flat_write_batch(store, buf, cnt);
+		if (!ret)
+			*done += cnt;
+		return ret;
+	}
+	/*
+	 * Under a key limit, go one key at a time so that kv_rmw reserves
+	 * each insert; the same while keys may still have to be copied from
+	 * a base, and for the ordered layout, whose inserts allocate one
+	 * node each.
+	 * A fork can still freeze the table after this check, so keys are
+	 * checked again under their bucket lock below.
+	 */
+	if (store->layout == KV_LAYOUT_ORDERED || kv_store_limited(store) ||
+	    kv_store_cow(store)) {
+		for (i = 0; i < cnt; i++) {
+			ret = kv_write(store, buf->keys[i], buf->vals[i]);
+			if (ret)
+				break;
+		}
+		*done += i;
+		return ret;
+	}
+	/* One node per key at worst, allocated outside the bucket locks */
+	if (kv_node_alloc_bulk(store, cnt, buf->nodes))
+		return -ENOMEM;
+
+	rcu_read_lock();
+	tbl = kv_tables(store, &old);
+	kv_batch_sort(buf, cnt, store, tbl);
+	while (i < cnt) {
+		unsigned int hash = buf->ents[i].hash, inserted = 0;
+		struct kv_bucket *bucket = NULL;
+		bool defer = false;
+
+		if (!old) {
+			bucket = &tbl->buckets[hash];
+			spin_lock(&bucket->lock);
+			if (bucket->moved) {
+				spin_unlock(&bucket->lock);
+				bucket = NULL;
+			}
+		}
+		/*
+		 * Entries of one bucket keep their order, so once a key is
+		 * deferred the rest of the bucket is too: a later write of
+		 * the same key must not land before it.
+		 */
+		for (; i < cnt && buf->ents[i].hash == hash; i++) {
+			unsigned int idx = buf->ents[i].idx;
+			int k = buf->keys[idx];
+			struct kv_bucket *b = bucket;
+
+			if (!b)
+				b = kv_bucket_lock(store, k);
+			defer = defer || kv_batch_defer(store, k);
+			if (defer) {
+				/* ents[] up to i has been read, reuse it */
+				buf->ents[deferred++].idx = idx;
+			} else {
+				kv_bucket_write(store, b, k, buf->vals[idx],
+						0, &buf->nodes[used]);
+				if (!buf->nodes[used]) {
+					used++;
+					inserted++;
+				}
+			}
+			if (!bucket) {
+				atomic_long_add(inserted, &store->nr_keys);
+				inserted = 0;
+				kv_bucket_unlock(b);
+			}
+		}
+		if (bucket) {
+			/* Counted while the bucket is still locked */
+			atomic_long_add(inserted, &store->nr_keys);
+			spin_unlock(&bucket->lock);
+		}
+	}
+	rcu_read_unlock();
+
+	if (used < cnt)
+		kmem_cache_free_bulk(kv_node_cachep, cnt - used,
+				     (void **)&buf->nodes[used]);
+	if (kv_store_over(store))
+		kv_evict(store);
+	kv_maybe_resize(store);
+	*done += cnt - deferred;
+	for (i = 0; i < deferred; i++) {
+		unsigned int idx = buf->ents[i].idx;
+
+		ret = kv_write(store, buf->keys[idx], buf->vals[idx]);
+		if (ret)
+			return ret;
+		++*done;
+	}
+	return 0;
+}
+
+SYSCALL_DEFINE3(write_kv_batch, const int __user *, keys, const int __user *, vals,
+		unsigned int, n) {
+	struct kv_store *store;
+	struct kv_batch_buf *buf;
+	unsigned int done = 0;
+	long ret = 0;
+
+	if (!n)
+		return 0;
+	store = kv_store_get_or_alloc();
+	if (!store)
+		return -ENOMEM;
+	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	while (done < n) {
+		unsigned int cnt = min_t(unsigned int, n - done, KV_BATCH_CHUNK);
+
+		if (copy_from_user(buf->keys, keys + done, cnt * sizeof(int)) ||
+		    copy_from_user(buf->vals, vals + done, cnt * sizeof(int))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = kv_batch_write(store, buf, cnt, &done);
+		if (ret)
+			break;
+		cond_resched();
+	}
+
+	kfree(buf);
+	/* Report partial progress like write(2) does */
+	return done ? done : ret;
+}
+
+SYSCALL_DEFINE3(read_kv_batch, const int __user *, keys, int __user *, vals,
+		unsigned int, n) {
+	struct kv_store *store = kv_store_get();
+	struct kv_batch_buf *buf;
+	unsigned int done = 0;
+	long ret = 0;
+
+	if (!n)
+		return 0;
+	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	while (done < n) {
+		unsigned int cnt = min_t(unsigned int, n - done, KV_BATCH_CHUNK);
+
+		if (copy_from_user(buf->keys, keys + done, cnt * sizeof(int))) {
+			ret = -EFAULT;
+			break;
+		}
+		rcu_read_lock();
+		for (unsigned int i = 0; i < cnt; i++) {
+			buf->vals[i] = -1;
+			if (store)
+				kv_read(store, buf->keys[i], &buf->vals[i]);
+		}
+		rcu_read_unlock();
+		if (copy_to_user(vals + done, buf->vals, cnt * sizeof(int))) {
+			ret = -EFAULT;
+			break;
+		}
+		done += cnt;
+		cond_resched();
+	}
+
+	kfree(buf);
+	return done ? done : ret;
+}
+
+/*
+ * kv_scan walks the store in batches. For the chained layout the cursor
+ * is a bucket index advanced in reversed-bit order (as in Redis SCAN):
+ * since bucket i of a 2^n table splits into buckets i and i + 2^n of the
+ * grown table, every key present for the whole scan is returned at least
+ * once even if the table is resized between calls. A bucket is returned
+ * whole or not at all. The flat layout never moves an entry within one
+ * table, so its cursor is a group index tagged with the table order, and
+ * a resize between calls restarts the walk (keys may then repeat).
+ * The ordered layout returns keys in order and its cursor is the next
+ * key, biased by 2^31 so that 0 can mean both the start and the end.
+ * Resizes run under ctl_mutex, which each call holds while it walks.
+ */
+#define KV_SCAN_MAX 65536
+
+static inline u32 kv_scan_next(u32 v, u32 mask) {
+	v |= ~mask;
+	v = bitrev32(v);
+	v++;
+	return bitrev32(v);
+}
+
+static int kv_table_scan(struct kv_store *store, unsigned long *cursor,
+			 int *keys, int *vals, unsigned int max) {
+	struct kv_table *tbl = rcu_dereference_protected(store->table,
+				lockdep_is_held(&store->ctl_mutex));
+	u32 mask = tbl->size - 1, v = *cursor;
+	unsigned int n = 0, walked = 0;
+
+	do {
+		struct kv_node *entry;
+		unsigned int start = n;
+		bool full = false;
+
+		rcu_read_lock();
+		hlist_for_each_entry_rcu(entry, &tbl->buckets[v & mask].head, node) {
+			if (kv_expired(entry))
+				continue;
+			if (n == max) {
+				full = true;
+				break;
+			}
+			keys[n] = entry->key;
+			vals[n] = READ_ONCE(entry->value);
+			n++;
+		}
+		rcu_read_unlock();
+		if (full) {
+			n = start;
+			if (!n)
+				return -EOVERFLOW; // bucket larger than max
+			break;
+		}
+		v = kv_scan_next(v, mask);
+		if (!(++walked % 1024))
+			cond_resched();
+	} while (v);
+
+	*cursor = v;
+	return n;
+}
+
+static int kv_flat_scan(struct kv_store *store, unsigned long *cursor,
+			int *keys, int *vals, unsigned int max) {
+	struct kv_flat *ft = rcu_dereference_protected(store->flat,
+				lockdep_is_held(&store->ctl_mutex));
+	unsigned long order = ilog2(ft->ngroups);
+	unsigned int g = (u32)*cursor, n = 0;
+
+	if (*cursor >> 32 != order)
+		g = 0; // new scan, or the table was resized since the last call
+	for (; g < ft->ngroups; g++) {
+		struct kv_flat_group *grp = &ft->groups[g];
+		u64 full = ~smp_load_acquire(&grp->ctrl) & KV_FLAT_HI;
+
+		if (n + hweight64(full) > max) {
+			if (!n)
+				return -EOVERFLOW;
+			break;
+		}
+		for (; full; full &= full - 1) {
+			unsigned int j = __ffs64(full) / 8;
+			keys[n] = grp->keys[j];
+			vals[n] = READ_ONCE(grp->vals[j]);
+			n++;
+		}
+		if (!(g % 1024))
+			cond_resched();
+	}
+
+	*cursor = g < ft->ngroups ? order << 32 | g : 0;
+	return n;
+}
+
+static int kv_ord_scan(struct kv_store *store, unsigned long *cursor,
+		       int *keys, int *vals, unsigned int max) {
+	int lo = (int)((u32)*cursor ^ 0x80000000U);
+	unsigned int n = kv_ord_range(store, lo, (s64)INT_MAX + 1, keys, vals, max);
+
+	if (n == max && keys[n - 1] != INT_MAX)
+		*cursor = (u32)(keys[n - 1] + 1) ^ 0x80000000U;
+	else
+		*cursor = 0;
+	return n;
+}
+
+/* Caller holds ctl_mutex */
+static int kv_store_scan(struct kv_store *store, unsigned long *cursor,
+			 int *keys, int *vals, unsigned int max) {
+	if (store->layout == KV_LAYOUT_ORDERED)
+		return kv_ord_scan(store, cursor, keys, vals, max);
+	if (store->layout == KV_LAYOUT_FLAT)
+		return kv_flat_scan(store, cursor, keys, vals, max);
+	return kv_table_scan(store, cursor, keys, vals, max);
+}
+
+/*
+ * Returns the number of entries stored in keys/vals and updates *cursor;
+ * start with 0 and stop when it comes back as 0.
+ */
+SYSCALL_DEFINE4(kv_scan, unsigned long __user *, cursor, int __user *, keys,
+		int __user *, vals, unsigned int, max) {
+	struct kv_store *store = kv_store_get();
+	unsigned long cur;
+	int *kkeys, *kvals;
+	long ret;
+
+	if (get_user(cur, cursor))
+		return -EFAULT;
+	if (!store)
+		return put_user(0UL, cursor) ? -EFAULT : 0;
+	max = min_t(unsigned int, max, KV_SCAN_MAX);
+	if (!max)
+		return -EINVAL;
+
+	kkeys = kvmalloc_array(max, sizeof(int), GFP_KERNEL);
+	kvals = kvmalloc_array(max, sizeof(int), GFP_KERNEL);
+	if (!kkeys || !kvals) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	/* Walking only the live table must see everything */
+	if (store->layout == KV_LAYOUT_HASH && kv_cow_copy_all(store)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	mutex_lock(&store->ctl_mutex);
+	ret = kv_store_scan(store, &cur, kkeys, kvals, max);
+	mutex_unlock(&store->ctl_mutex);
+
+	if (ret > 0 && (copy_to_user(keys, kkeys, ret * sizeof(int)) ||
+			copy_to_user(vals, kvals, ret * sizeof(int))))
+		ret = -EFAULT;
+	if (ret >= 0 && put_user(cur, cursor))
+		ret = -EFAULT;
+out:
+	kvfree(kkeys);
+	kvfree(kvals);
+	return ret;
+}
+
+/*
+ * Entries with lo <= key < hi, in key order, at most max of them. If max
+ * come back, call again from the last key + 1. Ordered layout only.
+ */
+SYSCALL_DEFINE5(kv_range, long, lo, long, hi, int __user *, keys,
+		int __user *, vals, unsigned int, max) {
+	struct kv_store *store = kv_store_get();
+	int *kkeys, *kvals;
+	long ret;
+
+	if (!store)
+		return 0;
+	if (store->layout != KV_LAYOUT_ORDERED)
+		return -EOPNOTSUPP;
+	max = min_t(unsigned int, max, KV_SCAN_MAX);
+	if (!max)
+		return -EINVAL;
+	lo = max_t(long, lo, INT_MIN);
+	hi = min_t(long, hi, (long)INT_MAX + 1);
+	if (lo >= hi)
+		return 0;
+
+	kkeys = kvmalloc_array(max, sizeof(int), GFP_KERNEL);
+	kvals = kvmalloc_array(max, sizeof(int), GFP_KERNEL);
+	if (!kkeys || !kvals) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = kv_ord_range(store, lo, hi, kkeys, kvals, max);
+	if (ret > 0 && (copy_to_user(keys, kkeys, ret * sizeof(int)) ||
+			copy_to_user(vals, kvals, ret * sizeof(int))))
+		ret = -EFAULT;
+out:
+	kvfree(kkeys);
+	kvfree(kvals);
+	return ret;
+}
+
+/*
+ * kv_dump/kv_load stream a store through a file: a kv_dump_hdr, then
+ * runs of up to KV_DUMP_RUN entries, each a kv_dump_run followed by len
+ * bytes of (key delta, value) varint pairs in key order. Keys are biased
+ * by 2^31 so that they sort as unsigned and the deltas are never
+ * negative; values are zigzag encoded. A run with nr == 0 ends the
+ * stream. Runs come from the kv_scan walk, so a key written during the
+ * dump may appear twice, which loading resolves in stream order. TTLs
+ * are not saved.
+ */
+#define KV_DUMP_MAGIC	0x3144564bU	/* "KVD1" */
+#define KV_DUMP_VERSION	1
+#define KV_DUMP_RUN	65536
+#define KV_VARINT_MAX	5
+#define KV_DUMP_RUN_MAX	(KV_DUMP_RUN * 2 * KV_VARINT_MAX)
+
+struct kv_dump_hdr {
+	__le32 magic;
+	__le32 version;
+};
+
+struct kv_dump_run {
+	__le32 nr;
+	__le32 len;	/* payload bytes */
+};
+
+static u8 *kv_put_varint(u8 *p, u32 x) {
+	for (; x >= 0x80; x >>= 7)
+		*p++ = x | 0x80;
+	*p++ = x;
+	return p;
+}
+
+static const u8 *kv_get_varint(const u8 *p, const u8 *end, u32 *x) {
+	u32 v = 0;
+
+	for (int shift = 0; shift < 7 * KV_VARINT_MAX && p < end; shift += 7) {
+		u8 b = *p++;
+		v |= (u32)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*x = v;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static int kv_pair_cmp(const void *a, const void *b) {
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int kv_file_write(struct file *file, loff_t *ppos, const void *buf,
+			 size_t len) {
+	while (len) {
+		ssize_t n = kernel_write(file, buf, len, ppos);
+		if (n < 0)
+			return n;
+		if (!n)
+			return -EIO;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read exactly @len bytes; -ENODATA if the stream ends first */
+static int kv_file_read(struct file *file, loff_t *ppos, void *buf, size_t len) {
+	while (len) {
+		ssize_t n = kernel_read(file, buf, len, ppos);
+		if (n < 0)
+			return n;
+		if (!n)
+			return -ENODATA;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+struct kv_dump_buf {
+	int keys[KV_DUMP_RUN];
+	int vals[KV_DUMP_RUN];
+	u64 pairs[KV_DUMP_RUN];
+	u8 out[sizeof(struct kv_dump_run) + KV_DUMP_RUN_MAX];
+};
+
+/* Sort and encode n entries of buf into one run, returns its size */
+static size_t kv_dump_encode(struct kv_dump_buf *buf, unsigned int n) {
+	struct kv_dump_run *run = (struct kv_dump_run *)buf->out;
+	u8 *p = buf->out + sizeof(*run);
+	u32 prev = 0;
+
+	for (unsigned int i = 0; i < n; i++)
+		buf->pairs[i] = (u64)((u32)buf->keys[i] ^ 0x80000000U) << 32 |
+				(u32)buf->vals[i];
+	sort(buf->pairs, n, sizeof(u64), kv_pair_cmp, NULL);
+	for (unsigned int i = 0; i < n; i++) {
+		u32 key = buf->pairs[i] >> 32;
+		s32 val = (s32)(u32)buf->pairs[i];
+
+		p = kv_put_varint(p, key - prev);
+		p = kv_put_varint(p, ((u32)val << 1) ^ (u32)(val >> 31));
+		prev = key;
+	}
+	run->nr = cpu_to_le32(n);
+	run->len = cpu_to_le32(p - buf->out - sizeof(*run));
+	return p - buf->out;
+}
+
+/* Returns the number of entries written to @fd */
+SYSCALL_DEFINE1(kv_dump, int, fd) {
+	struct kv_dump_hdr hdr = {
+		.magic = cpu_to_le32(KV_DUMP_MAGIC),
+		.version = cpu_to_le32(KV_DUMP_VERSION),
+	};
+	struct kv_dump_run end = {};
+	struct kv_store *store = kv_store_get();
+	struct fd f = fdget_pos(fd);
+	struct kv_dump_buf *buf = NULL;
+	unsigned long cur = 0;
+	loff_t pos;
+	long ret, total = 0;
+
+	if (!f.file)
+		return -EBADF;
+	if (!(f.file->f_mode & FMODE_WRITE)) {
+		ret = -EBADF;
+		goto out;
+	}
+	buf = kvmalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	pos = f.file->f_pos;
+	ret = kv_file_write(f.file, &pos, &hdr, sizeof(hdr));
+
+	if (!ret && store && store->layout == KV_LAYOUT_HASH &&
+	    kv_cow_copy_all(store))
+		ret = -ENOMEM;
+	while (!ret && store) {
+		int n;
+
+		mutex_lock(&store->ctl_mutex);
+		n = kv_store_scan(store, &cur, buf->keys, buf->vals, KV_DUMP_RUN);
+		mutex_unlock(&store->ctl_mutex);
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		if (n)
+			ret = kv_file_write(f.file, &pos, buf->out,
+					   kv_dump_encode(buf, n));
+		if (!ret)
+			total += n;
+		if (!cur)
+			break;
+		cond_resched();
+	}
+	if (!ret)
+		ret = kv_file_write(f.file, &pos, &end, sizeof(end));
+	f.file->f_pos = pos;
+out:
+	kvfree(buf);
+	fdput_pos(f);
+	return ret ? ret : total;
+}
+
+/*
+ * Load a kv_dump stream from @fd into the store, overwriting keys that
+ * are already there. Returns the number of entries loaded; on a bad
+ * stream the entries before the error stay loaded.
+ */
+SYSCALL_DEFINE1(kv_load, int, fd) {
+	struct kv_store *store = kv_store_get_or_alloc();
+	struct fd f = fdget_pos(fd);
+	struct kv_batch_buf *batch = NULL;
+	struct kv_dump_hdr hdr;
+	unsigned int done = 0;
+	u8 *in = NULL;
+	loff_t pos;
+	long ret;
+
+	if (!f.file)
+		return -EBADF;
+	if (!store) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (!(f.file->f_mode & FMODE_READ)) {
+		ret = -EBADF;
+		goto out;
+	}
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	in = kvmalloc(KV_DUMP_RUN_MAX, GFP_KERNEL);
+	if (!batch || !in) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	pos = f.file->f_pos;
+	ret = kv_file_read(f.file, &pos, &hdr, sizeof(hdr));
+	if (!ret && (le32_to_cpu(hdr.magic) != KV_DUMP_MAGIC ||
+		     le32_to_cpu(hdr.version) != KV_DUMP_VERSION))
+		ret = -EINVAL;
+
+	while (!ret) {
+		struct kv_dump_run run;
+		const u8 *p = in, *endp;
+		unsigned int nr, len, cnt = 0;
+		u32 key = 0;
+
+		ret = kv_file_read(f.file, &pos, &run, sizeof(run));
+		if (ret)
+			break;
+		nr = le32_to_cpu(run.nr);
+		len = le32_to_cpu(run.len);
+		if (!nr)
+			break;
+		if (nr > KV_DUMP_RUN || len > KV_DUMP_RUN_MAX) {
+			ret = -EINVAL;
+			break;
+		}
+		ret = kv_file_read(f.file, &pos, in, len);
+		if (ret)
+			break;
+		endp = in + len;
+
+		for (unsigned int i = 0; i < nr && !ret; i++) {
+			u32 delta, val;
+
+			p = kv_get_varint(p, endp, &delta);
+			if (p)
+				p = kv_get_varint(p, endp, &val);
+			if (!p) {
+				ret = -EINVAL;
+				break;
+			}
+			key += delta;
+			batch->keys[cnt] = (int)(key ^ 0x80000000U);
+			batch->vals[cnt] = (int)((val >> 1) ^ -(val & 1));
+			if (++cnt == KV_BATCH_CHUNK) {
+				ret = kv_batch_write(store, batch, cnt, &done);
+				cnt = 0;
+			}
+		}
+		if (!ret && p != endp)
+			ret = -EINVAL;
+		if (!ret && cnt)
+			ret = kv_batch_write(store, batch, cnt, &done);
+		cond_resched();
+	}
+	f.file->f_pos = pos;
+out:
+	kfree(batch);
+	kvfree(in);
+	fdput_pos(f);
+	return ret ? ret : done;
+}
+
+/*
+ * Copy the store into a fresh mirror. Caller holds ctl_mutex, so no
+ * resize is in flight; each key is copied under the same lock its
+ * writers mirror under, so a concurrent write is never overtaken.
+ */
+static void kv_shared_fill(struct kv_store *store, struct kv_shared *sh) {
+	if (store->layout == KV_LAYOUT_ORDERED) {
+		struct kv_onode *e;
+		unsigned long i = 0;
+
+		/* Writers insert under flat_lock, so the walk holds it too */
+		spin_lock(&store->flat_lock);
+		for (struct rb_node *n = rb_first(&store->ord_root); n; n = rb_next(n)) {
+			e = rb_entry(n, struct kv_onode, rb);
+			kv_shared_set(sh, e->key, e->value, KV_SLOT_FULL);
+			if (!(++i % 1024) && spin_needbreak(&store->flat_lock)) {
+				spin_unlock(&store->flat_lock);
+				cond_resched();
+				spin_lock(&store->flat_lock);
+			}
+		}
+		spin_unlock(&store->flat_lock);
+	} else if (store->layout == KV_LAYOUT_FLAT) {
+		struct kv_flat *ft = rcu_dereference_protected(store->flat, 1);
+
+		for (unsigned int i = 0; i < ft->ngroups; i++) {
+			struct kv_flat_group *grp = &ft->groups[i];
+
+			spin_lock(&store->flat_lock);
+			for (u64 full = ~grp->ctrl & KV_FLAT_HI; full; full &= full - 1) {
+				unsigned int j = __ffs64(full) / 8;
+				kv_shared_set(sh, grp->keys[j], grp->vals[j], KV_SLOT_FULL);
+			}
+			spin_unlock(&store->flat_lock);
+			cond_resched();
+		}
+	} else {
+		struct kv_table *tbl = rcu_dereference_protected(store->table, 1);
+
+		for (unsigned int i = 0; i < tbl->size; i++) {
+			struct kv_bucket *bucket = &tbl->buckets[i];
+			struct kv_node *entry;
+
+			spin_lock(&bucket->lock);
+			hlist_for_each_entry(entry, &bucket->head, node)
+				if (!kv_expired(entry))
+					kv_shared_set(sh, entry->key, entry->value,
+						      KV_SLOT_FULL);
+			spin_unlock(&bucket->lock);
+			cond_resched();
+		}
+	}
+}
+
+/* Returns a read-only mmap()able fd of the store's mirror */
+static long kv_ctl_map_shared(struct kv_store *store, unsigned long nslots) {
+	struct kv_shared *sh = store->shared;
+	int fd;
+
+	if (!sh) {
+		if (nslots < KV_SHARED_MIN_SLOTS || nslots > KV_SHARED_MAX_SLOTS ||
+		    !is_power_of_2(nslots))
+			return -EINVAL;
+		sh = kv_shared_alloc(nslots, NUMA_NO_NODE);
+		if (!sh)
+			return -ENOMEM;
+		WRITE_ONCE(store->shared, sh);
+		kv_shared_fill(store, sh);
+	}
+	refcount_inc(&sh->refs);
+	fd = anon_inode_getfd("[kv_shared]", &kv_shared_fops, sh,
+			      O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		put_kv_shared(sh);
+	return fd;
+}
+
+/*
+ * Later allocations only: tables from the next resize on and new nodes
+ * go to the new node, what is already there stays where it is.
+ */
+static long kv_ctl_set_node(struct kv_store *store, unsigned long arg) {
+	long nid = arg;
+
+	if (nid < 0)
+		nid = kv_home_node();
+	else if (nid >= nr_node_ids || !node_online(nid))
+		return -EINVAL;
+	WRITE_ONCE(store->node, nid);
+	return 0;
+}
+
+/* Enable-only, like KV_CTL_MAP_SHARED; nodes onlined later go without */
+static long kv_ctl_set_replicas(struct kv_store *store, unsigned long nslots) {
+	struct kv_shared **rep;
+	int nid;
+
+	if (store->replicas)
+		return -EBUSY;
+	if (nslots < KV_SHARED_MIN_SLOTS || nslots > KV_SHARED_MAX_SLOTS ||
+	    !is_power_of_2(nslots))
+		return -EINVAL;
+	rep = kcalloc(nr_node_ids, sizeof(*rep), GFP_KERNEL);
+	if (!rep)
+		return -ENOMEM;
+	for_each_online_node(nid) {
+		rep[nid] = kv_shared_alloc(nslots, nid);
+		if (!rep[nid])
+			goto fail;
+	}
+	/* Writers update the replicas from here on, readers after the fill */
+	WRITE_ONCE(store->replicas, rep);
+	for_each_online_node(nid)
+		if (rep[nid])
+			kv_shared_fill(store, rep[nid]);
+	smp_store_release(&store->replicas_ready, true);
+	return 0;
+
+fail:
+	for_each_node(nid)
+		put_kv_shared(rep[nid]);
+	kfree(rep);
+	return -ENOMEM;
+}
+
+/*
+ * Per-process KV store settings. Layout-changing options must be set
+ * before the first write_kv and fail with -EBUSY afterwards.
+ */
+SYSCALL_DEFINE2(kv_ctl, int, op, unsigned long, arg) {
+	struct kv_store *store;
+	long ret = 0;
+
+	/* Options that need the first table in place */
+	if (op == KV_CTL_MAP_SHARED || op == KV_CTL_SET_REPLICAS)
+		store = kv_store_get_or_alloc();
+	else
+		store = kv_store_attach();
+	if (!store)
+		return -ENOMEM;
+	/* The mirror is filled from the live table only */
+	if ((op == KV_CTL_MAP_SHARED || op == KV_CTL_SET_REPLICAS) &&
+	    store->layout == KV_LAYOUT_HASH && kv_cow_copy_all(store))
+		return -ENOMEM;
+
+	mutex_lock(&store->ctl_mutex);
+	switch (op) {
+	case KV_CTL_SET_LAYOUT:
+		if (arg != KV_LAYOUT_HASH && arg != KV_LAYOUT_FLAT &&
+		    arg != KV_LAYOUT_ORDERED)
+			ret = -EINVAL;
+		else if (store->active)
+			ret = -EBUSY;
+		else if (arg != KV_LAYOUT_HASH && (store->evict || store->inherit))
+			ret = -EOPNOTSUPP;
+		else if (arg == KV_LAYOUT_FLAT && !xa_empty(&store->watches))
+			ret = -EOPNOTSUPP;	// kv_watch on a store not yet written
+		else
+			store->layout = arg;
+		break;
+	case KV_CTL_GET_LAYOUT:
+		ret = store->layout;
+		break;
+	case KV_CTL_MAP_SHARED:
+		ret = kv_ctl_map_shared(store, arg);
+		break;
+	case KV_CTL_SET_LIMIT:
+		WRITE_ONCE(store->limit, arg);
+		break;
+	case KV_CTL_SET_INHERIT:
+		if (arg && store->layout != KV_LAYOUT_HASH)
+			ret = -EOPNOTSUPP;
+		else
+			WRITE_ONCE(store->inherit, !!arg);
+		break;
+	case KV_CTL_SET_NODE:
+		ret = kv_ctl_set_node(store, arg);
+		break;
+	case KV_CTL_SET_REPLICAS:
+		/* A replica hit cannot set the CLOCK bit of the node */
+		if (store->evict)
+			ret = -EOPNOTSUPP;
+		else
+			ret = kv_ctl_set_replicas(store, arg);
+		break;
+	case KV_CTL_SET_EVICT:
+		/* Only the chained layout can delete, so only it can evict */
+		if (arg && (store->layout != KV_LAYOUT_HASH || store->replicas))
+			ret = -EOPNOTSUPP;
+		else
+			WRITE_ONCE(store->evict, !!arg);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	mutex_unlock(&store->ctl_mutex);
+	return ret;
+}
+
+/*
+ * Named KV namespaces: a kv_store that is not tied to a thread group,
+ * found by name and reached through the fd kv_attach returns. The fd
+ * holds a reference and the namespace goes away with the last one.
+ * Permissions are checked at attach time against the owner, group and
+ * mode recorded when the namespace was created, like System V IPC, and
+ * the fd remembers whether it may write. Names are looked up in the
+ * creator's IPC namespace, which each kv_ns pins, so containers with
+ * their own IPC namespace do not see each other's stores.
+ */
+#define KV_NS_NAME_MAX	64
+#define KV_NS_HASH_BITS	6
+
+struct kv_ns {
+	struct hlist_node node;	/* in kv_ns_table, under kv_ns_mutex */
+	refcount_t refs;
+	struct ipc_namespace *ipc_ns;	/* the name is only seen from here */
+	kuid_t uid;
+	kgid_t gid;
+	umode_t mode;
+	struct kv_store *store;
+	char name[KV_NS_NAME_MAX];
+};
+
+static DEFINE_HASHTABLE(kv_ns_table, KV_NS_HASH_BITS);
+static DEFINE_MUTEX(kv_ns_mutex);
+
+static void put_kv_ns(struct kv_ns *ns) {
+	if (!refcount_dec_and_mutex_lock(&ns->refs, &kv_ns_mutex))
+		return;
+	hash_del(&ns->node);
+	mutex_unlock(&kv_ns_mutex);
+	put_kv_store(ns->store);
+	put_ipc_ns(ns->ipc_ns);
+	kfree(ns);
+}
+
+static int kv_ns_release(struct inode *inode, struct file *file) {
+	put_kv_ns(file->private_data);
+	return 0;
+}
+
+static const struct file_operations kv_ns_fops = {
+	.release	= kv_ns_release,
+	.llseek		= noop_llseek,
+};
+
+/* Caller holds kv_ns_mutex */
+static struct kv_ns *kv_ns_find(struct ipc_namespace *ipc_ns,
+				const char *name, u32 hash) {
+	struct kv_ns *ns;
+
+	hash_for_each_possible(kv_ns_table, ns, node, hash)
+		if (ns->ipc_ns == ipc_ns && !strcmp(ns->name, name))
+			return ns;
+	return NULL;
+}
+
+/* @may is MAY_READ and/or MAY_WRITE */
+static bool kv_ns_permitted(struct kv_ns *ns, int may) {
+	umode_t mode = ns->mode;
+
+	if (uid_eq(current_fsuid(), ns->uid))
+		mode >>= 6;
+	else if (in_group_p(ns->gid))
+		mode >>= 3;
+	return (may & ~mode & (MAY_READ | MAY_WRITE)) == 0 ||
+	       ns_capable(ns->ipc_ns->user_ns, CAP_IPC_OWNER);
+}
+
+/* A namespace for kv_attach to publish, with an active store */
+static struct kv_ns *kv_ns_alloc(struct ipc_namespace *ipc_ns,
+				 const char *name, umode_t mode) {
+	struct kv_ns *ns = kzalloc(sizeof(*ns), GFP_KERNEL_ACCOUNT);
+
+	if (!ns)
+		return NULL;
+	ns->store = kv_store_alloc();
+	if (!ns->store || kv_store_activate(ns->store)) {
+		put_kv_store(ns->store);
+		kfree(ns);
+		return NULL;
+	}
+	refcount_set(&ns->refs, 1);
+	ns->ipc_ns = get_ipc_ns(ipc_ns);
+	ns->uid = current_fsuid();
+	ns->gid = current_fsgid();
+	ns->mode = mode & S_IRWXUGO;
+	strscpy(ns->name, name, sizeof(ns->name));
+	return ns;
+}
+
+/*
+ * Create or open the namespace @name. @flags takes O_RDONLY or O_RDWR
+ * and optionally O_CREAT, O_EXCL and O_CLOEXEC; @mode is used when the
+ * namespace is created. Returns an fd for kv_ns_write and kv_ns_read.
+ */
+SYSCALL_DEFINE3(kv_attach, const char __user *, uname, int, flags,
+		umode_t, mode) {
+	struct ipc_namespace *ipc_ns = current->nsproxy->ipc_ns;
+	int acc = flags & O_ACCMODE, may = MAY_READ;
+	struct kv_ns *ns, *fresh = NULL;
+	char name[KV_NS_NAME_MAX];
+	long len;
+	u32 hash;
+	int fd;
+
+	if (flags & ~(O_ACCMODE | O_CREAT | O_EXCL | O_CLOEXEC) ||
+	    (acc != O_RDONLY && acc != O_RDWR))
+		return -EINVAL;
+	if (acc == O_RDWR)
+		may |= MAY_WRITE;
+	len = strncpy_from_user(name, uname, sizeof(name));
+	if (len < 0)
+		return len;
+	if (!len)
+		return -EINVAL;
+	if (len == sizeof(name))
+		return -ENAMETOOLONG;
+	hash = jhash(name, len, hash32_ptr(ipc_ns));
+
+	/*
+	 * Opening an existing name never allocates. On a miss with O_CREAT
+	 * the store is built outside kv_ns_mutex, and the name is looked up
+	 * again: the loser of a race to create it opens the winner's.
+	 */
+	mutex_lock(&kv_ns_mutex);
+again:
+	ns = kv_ns_find(ipc_ns, name, hash);
+	if (ns) {
+		if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+			ns = ERR_PTR(-EEXIST);
+		} else if (!kv_ns_permitted(ns, may)) {
+			ns = ERR_PTR(-EACCES);
+		} else {
+			refcount_inc(&ns->refs);
+		}
+	} else if (fresh) {
+		ns = fresh;
+		fresh = NULL;
+		hash_add(kv_ns_table, &ns->node, hash);
+	} else if (flags & O_CREAT) {
+		mutex_unlock(&kv_ns_mutex);
+		fresh = kv_ns_alloc(ipc_ns, name, mode);
+		if (!fresh)
+			return -ENOMEM;
+		mutex_lock(&kv_ns_mutex);
+		goto again;
+	} else {
+		ns = ERR_PTR(-ENOENT);
+	}
+	mutex_unlock(&kv_ns_mutex);
+
+	if (fresh) {
+		put_kv_store(fresh->store);
+		put_ipc_ns(fresh->ipc_ns);
+		kfree(fresh);
+	}
+	if (IS_ERR(ns))
+		return PTR_ERR(ns);
+	fd = anon_inode_getfd("[kv_ns]", &kv_ns_fops, ns,
+			      acc | (flags & O_CLOEXEC));
+	if (fd < 0)
+		put_kv_ns(ns);
+	return fd;
+}
+
+/*
+ * kv_snapshot freezes the caller's store the way a fork with
+ * KV_CTL_SET_INHERIT does and hands out the frozen side as a read-only
+ * fd, which kv_ns_read accepts. Nothing ever writes to the snapshot, so
+ * every read through it sees the store as it was at kv_snapshot time.
+ * Writers of the live store copy a bucket out of the shared base the
+ * first time they touch it and never wait for readers of the snapshot.
+ */
+static int kv_snap_release(struct inode *inode, struct file *file) {
+	struct kv_store *snap = file->private_data;
+
+	/*
+	 * The fd holds the only reference. Tear down here rather than from
+	 * the workqueue, so that the base is unshared by the time close()
+	 * returns and the next kv_snapshot can take it back.
+	 */
+	if (refcount_dec_and_test(&snap->refs))
+		kv_free_work(&snap->free_work);
+	return 0;
+}
+
+static const struct file_operations kv_snap_fops = {
+	.release	= kv_snap_release,
+	.llseek		= noop_llseek,
+};
+
+/* Returns an fd for kv_ns_read; chained layout only */
+SYSCALL_DEFINE1(kv_snapshot, int, flags) {
+	struct kv_store *store, *snap;
+	int fd;
+
+	if (flags & ~O_CLOEXEC)
+		return -EINVAL;
+	store = kv_store_get_or_alloc();
+	if (!store)
+		return -ENOMEM;
+	if (store->layout != KV_LAYOUT_HASH)
+		return -EOPNOTSUPP;
+	snap = kv_store_clone(store);
+	if (IS_ERR(snap))
+		return PTR_ERR(snap);
+	fd = anon_inode_getfd("[kv_snapshot]", &kv_snap_fops, snap,
+			      O_RDONLY | flags);
+	if (fd < 0)
+		put_kv_store(snap);
+	return fd;
+}
+
+/*
+ * Store behind a kv_attach or kv_snapshot fd, which must have been
+ * opened for @fmode
+ */
+static struct kv_store *kv_ns_store(struct fd f, fmode_t fmode) {
+	if (!f.file || !(f.file->f_mode & fmode))
+		return ERR_PTR(-EBADF);
+	if (f.file->f_op == &kv_snap_fops)
+		return f.file->private_data;
+	if (f.file->f_op != &kv_ns_fops)
+		return ERR_PTR(-EBADF);
+	return ((struct kv_ns *)f.file->private_data)->store;
+}
+
+SYSCALL_DEFINE3(kv_ns_write, int, fd, int, k, int, v) {
+	struct fd f = fdget(fd);
+	struct kv_store *store = kv_ns_store(f, FMODE_WRITE);
+	long ret = PTR_ERR_OR_ZERO(store);
+
+	if (!ret)
+		ret = kv_write(store, k, v);
+	fdput(f);
+	return ret;
+}
+
+/* Returns 0 and stores the value in *v, or -ENOENT if k is absent */
+SYSCALL_DEFINE3(kv_ns_read, int, fd, int, k, int __user *, v) {
+	struct fd f = fdget(fd);
+	struct kv_store *store = kv_ns_store(f, FMODE_READ);
+	long ret = PTR_ERR_OR_ZERO(store);
+	int value;
+
+	if (!ret) {
+		rcu_read_lock();
+		if (kv_read(store, k, &value) <= 0)
+			ret = -ENOENT;
+		rcu_read_unlock();
+	}
+	fdput(f);
+	if (!ret && put_user(value, v))
+		ret = -EFAULT;
+	return ret;
+}
+
+/*
+ * Blob values: write_kv_blob/read_kv_blob keep byte strings of up to
+ * KV_BLOB_MAX under 64-bit keys, a key space of their own next to the
+ * int store. A value of up to KV_BLOB_INLINE bytes is stored in its
+ * kv_blob; a larger one comes from the store's arena, which carves
+ * KV_ARENA_CHUNK chunks into power-of-two size classes and keeps freed
+ * objects on per-class free lists, so rewriting values of similar sizes
+ * reuses the same memory. Values beyond the largest class are vmalloc'd.
+ *
+ * A blob is never changed once published: a write builds a new one and
+ * swaps it in under blobs->mutex, and the old one goes back after a
+ * grace period, so readers copy values out under rcu_read_lock() alone.
+ * Each pending free holds a store reference, which keeps the arena
+ * around until the callback has run. Blobs are not inherited by forks
+ * nor saved by kv_dump, and KV_CTL_SET_LIMIT does not count them: their
+ * memory is charged to the memory cgroup instead.
+ */
+#define KV_BLOB_INLINE		64
+#define KV_BLOB_MAX		(1U << 20)
+#define KV_ARENA_CHUNK		(64 * 1024)
+#define KV_ARENA_MIN_SHIFT	7	/* smallest class, above the inline size */
+#define KV_ARENA_MAX_SHIFT	14	/* largest class, 16 KiB */
+#define KV_ARENA_CLASSES	(KV_ARENA_MAX_SHIFT - KV_ARENA_MIN_SHIFT + 1)
+
+struct kv_blob {
+	struct rhash_head node;
+	u64 key;
+	unsigned int len;
+	struct kv_store *store;
+	struct rcu_head rcu;
+	u8 *data;		/* inline[], the arena or vmalloc */
+	u8 inline_data[];
+};
+
+struct kv_arena_class {
+	struct llist_node *free;	/* under blobs->mutex */
+	struct llist_head freed;	/* pushed by RCU callbacks */
+	char *cur, *end;		/* not carved yet in the last chunk */
+};
+
+struct kv_arena_chunk {
+	struct kv_arena_chunk *next;
+	char objs[] __aligned(SMP_CACHE_BYTES);
+};
+
+struct kv_blobs {
+	struct rhashtable ht;
+	struct mutex mutex;		/* writers and the arena */
+	struct kv_arena_chunk *chunks;
+	struct kv_arena_class classes[KV_ARENA_CLASSES];
+};
+
+static const struct rhashtable_params kv_blob_params = {
+	.key_len = sizeof(u64),
+	.key_offset = offsetof(struct kv_blob, key),
+	.head_offset = offsetof(struct kv_blob, node),
+	.automatic_shrinking = true,
+};
+
+/* Size class of a value too big to be inline, -1 if it is vmalloc'd */
+static inline int kv_arena_class(unsigned int len) {
+	unsigned int shift = max_t(unsigned int, order_base_2(len),
+				   KV_ARENA_MIN_SHIFT);
+	return shift > KV_ARENA_MAX_SHIFT ? -1 : shift - KV_ARENA_MIN_SHIFT;
+}
+
+/* Caller holds blobs->mutex */
+static void *kv_arena_alloc(struct kv_blobs *blobs, int c) {
+	struct kv_arena_class *cl = &blobs->classes[c];
+	size_t size = 1UL << (c + KV_ARENA_MIN_SHIFT);
+	struct kv_arena_chunk *chunk;
+	void *obj;
+
+	if (!cl->free)
+		cl->free = llist_del_all(&cl->freed);
+	if (cl->free) {
+		obj = cl->free;
+		cl->free = cl->free->next;
+		return obj;
+	}
+	if (cl->end - cl->cur < size) {
+		chunk = kvmalloc(KV_ARENA_CHUNK, GFP_KERNEL_ACCOUNT);
+		if (!chunk)
+			return NULL;
+		chunk->next = blobs->chunks;
+		blobs->chunks = chunk;
+		cl->cur = chunk->objs;
+		cl->end = (char *)chunk + KV_ARENA_CHUNK;
+	}
+	obj = cl->cur;
+	cl->cur += size;
+	return obj;
+}
+
+/* Any context: arena objects only go back to their class */
+static void kv_blob_release(struct kv_blobs *blobs, struct kv_blob *b) {
+	if (b->len > KV_BLOB_INLINE) {
+		int c = kv_arena_class(b->len);
+
+		if (c < 0)
+			kvfree(b->data);
+		else
+			llist_add((struct llist_node *)b->data, &blobs->classes[c].freed);
+	}
+	kfree(b);
+}
+
+static void kv_blob_free_rcu(struct rcu_head *head) {
+	struct kv_blob *b = container_of(head, struct kv_blob, rcu);
+	struct kv_store *store = b->store;
+
+	kv_blob_release(store->blobs, b);
+	put_kv_store(store);
+}
+
+/* Teardown: no readers and no RCU callbacks are left */
+static void kv_blob_destroy(void *ptr, void *arg) {
+	struct kv_blob *b = ptr;
+
+	if (kv_arena_class(b->len) < 0)
+		kvfree(b->data);
+	kfree(b);
+}
+
+static void kv_blobs_free(struct kv_blobs *blobs) {
+	struct kv_arena_chunk *chunk, *next;
+
+	rhashtable_free_and_destroy(&blobs->ht, kv_blob_destroy, NULL);
+	for (chunk = blobs->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		kvfree(chunk);
+	}
+	kfree(blobs);
+}
+
+static struct kv_blobs *kv_blobs_get_or_alloc(struct kv_store *store) {
+	struct kv_blobs *blobs = smp_load_acquire(&store->blobs);
+
+	if (blobs)
+		return blobs;
+	mutex_lock(&store->ctl_mutex);
+	blobs = store->blobs;
+	if (!blobs) {
+		blobs = kzalloc(sizeof(*blobs), GFP_KERNEL_ACCOUNT);
+		if (blobs && rhashtable_init(&blobs->ht, &kv_blob_params)) {
+			kfree(blobs);
+			blobs = NULL;
+		}
+		if (blobs) {
+			mutex_init(&blobs->mutex);
+			smp_store_release(&store->blobs, blobs);
+		}
+	}
+	mutex_unlock(&store->ctl_mutex);
+	return blobs;
+}
+
+/* Store len bytes from buf under k, replacing any previous value */
+SYSCALL_DEFINE3(write_kv_blob, u64, k, const void __user *, buf,
+		unsigned int, len) {
+	struct kv_store *store;
+	struct kv_blobs *blobs;
+	struct kv_blob *b, *old;
+	int c = -1;
+	long ret = 0;
+
+	if (len > KV_BLOB_MAX)
+		return -E2BIG;
+	store = kv_store_get_or_alloc();
+	blobs = store ? kv_blobs_get_or_alloc(store) : NULL;
+	if (!blobs)
+		return -ENOMEM;
+	b = kmalloc(struct_size(b, inline_data, len <= KV_BLOB_INLINE ? len : 0),
+		    GFP_KERNEL_ACCOUNT);
+	if (!b)
+		return -ENOMEM;
+	b->key = k;
+	b->len = len;
+	b->store = store;
+	b->data = b->inline_data;
+
+	if (len > KV_BLOB_INLINE) {
+		c = kv_arena_class(len);
+		if (c < 0) {
+			b->data = kvmalloc(len, GFP_KERNEL_ACCOUNT);
+		} else {
+			mutex_lock(&blobs->mutex);
+			b->data = kv_arena_alloc(blobs, c);
+			mutex_unlock(&blobs->mutex);
+		}
+		if (!b->data) {
+			kfree(b);
+			return -ENOMEM;
+		}
+	}
+	/* Fill it before taking the mutex, it may fault */
+	if (copy_from_user(b->data, buf, len)) {
+		kv_blob_release(blobs, b);
+		return -EFAULT;
+	}
+
+	mutex_lock(&blobs->mutex);
+	old = rhashtable_lookup_get_insert_fast(&blobs->ht, &b->node, kv_blob_params);
+	if (IS_ERR(old)) {
+		ret = PTR_ERR(old);
+	} else if (old) {
+		ret = rhashtable_replace_fast(&blobs->ht, &old->node, &b->node,
+					      kv_blob_params);
+		if (!ret) {
+			get_kv_store(store); // dropped by kv_blob_free_rcu
+			call_rcu(&old->rcu, kv_blob_free_rcu);
+		}
+	}
+	mutex_unlock(&blobs->mutex);
+	if (ret)
+		kv_blob_release(blobs, b);
+	return ret;
+}
+
+/*
+ * Copy the value of k into buf, at most len bytes, and return its full
+ * length (which may be larger than len), or -ENOENT if k is absent.
+ */
+SYSCALL_DEFINE3(read_kv_blob, u64, k, void __user *, buf, unsigned int, len) {
+	struct kv_store *store = kv_store_get();
+	struct kv_blobs *blobs = store ? smp_load_acquire(&store->blobs) : NULL;
+	u8 stack[KV_BLOB_INLINE], *bounce = stack;
+	unsigned int size = sizeof(stack), n = 0;
+	struct kv_blob *b;
+	long ret;
+
+	if (!blobs)
+		return -ENOENT;
+	len = min(len, KV_BLOB_MAX);
+	/*
+	 * The value cannot change under us, but it can go away or be replaced.
+	 * Size the bounce buffer to what is there rather than to @len, and
+	 * look again if a larger value replaced it meanwhile.
+	 */
+	for (;;) {
+		rcu_read_lock();
+		b = rhashtable_lookup(&blobs->ht, &k, kv_blob_params);
+		if (!b) {
+			rcu_read_unlock();
+			ret = -ENOENT;
+			break;
+		}
+		ret = b->len;
+		n = min(len, b->len);
+		if (n <= size) {
+			memcpy(bounce, b->data, n);
+			rcu_read_unlock();
+			break;
+		}
+		rcu_read_unlock();
+		if (bounce != stack)
+			kvfree(bounce);
+		bounce = kvmalloc(n, GFP_KERNEL);
+		if (!bounce)
+			return -ENOMEM;
+		size = n;
+	}
+	if (ret >= 0 && copy_to_user(buf, bounce, n))
+		ret = -EFAULT;
+	if (bounce != stack)
+		kvfree(bounce);
+	return ret;
+}
+
+static u64 kv_stat_sum(struct kv_store *store, size_t off) {
+	u64 sum = 0;
+	int cpu;
+
+	if (!store)
+		return 0;
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((void *)per_cpu_ptr(store->stats, cpu) + off);
+	return sum;
+}
+
+#define KV_STAT(store, field) kv_stat_sum(store, offsetof(struct kv_stats, field))
+
+static void kv_stat_hist(struct seq_file *m, struct kv_store *store,
+			 const char *name, size_t off) {
+	seq_printf(m, "%s:\n", name);
+	for (unsigned int i = 0; i < KV_LAT_SLOTS; i++) {
+		u64 n = kv_stat_sum(store, off + i * sizeof(u64));
+
+		if (!n)
+			continue;
+		if (i == KV_LAT_SLOTS - 1)
+			seq_printf(m, "  %12llu -            : %llu\n", 1ULL << i, n);
+		else
+			seq_printf(m, "  %12llu - %12llu: %llu\n", i ? 1ULL << i : 0,
+				   (2ULL << i) - 1, n);
+	}
+}
+
+/* Keys in the live tables and those still only in a fork's base */
+static long kv_store_nr_keys(struct kv_store *store) {
+	long n = atomic_long_read(&store->nr_keys);
+	struct kv_table *tbl;
+	struct kv_cow *cow;
+
+	if (store->layout != KV_LAYOUT_HASH)
+		return n;
+	rcu_read_lock();
+	tbl = rcu_dereference(store->table);
+	cow = READ_ONCE(tbl->cow);
+	if (cow)
+		n += READ_ONCE(cow->nr_keys);
+	rcu_read_unlock();
+	return n;
+}
+
+/*
+ * /proc/<pid>/kv_stats: counters of the thread group's store, summed over
+ * all CPUs, and the write_kv/read_kv latency histograms in ns (see struct
+ * kv_stats for what is counted). The store lives as long as the task's
+ * signal_struct, which the task_struct (pinned by the proc inode) keeps.
+ */
+int proc_pid_kv_stats(struct seq_file *m, struct pid_namespace *ns,
+		      struct pid *pid, struct task_struct *task) {
+	struct kv_store *store;
+
+	if (!ptrace_may_access(task, PTRACE_MODE_READ_FSCREDS))
+		return -EACCES;
+	store = smp_load_acquire(&task->signal->kv_store);
+	if (store && !smp_load_acquire(&store->active))
+		store = NULL;	/* no counters yet */
+
+	seq_printf(m, "keys %ld\n", store ? kv_store_nr_keys(store) : 0);
+	seq_printf(m, "reads %llu\n", KV_STAT(store, reads));
+	seq_printf(m, "read_misses %llu\n", KV_STAT(store, read_misses));
+	seq_printf(m, "writes %llu\n", KV_STAT(store, writes));
+	seq_printf(m, "write_errors %llu\n", KV_STAT(store, write_errors));
+	seq_printf(m, "lock_contended %llu\n", KV_STAT(store, contended));
+	kv_stat_hist(m, store, "read_ns", offsetof(struct kv_stats, read_ns));
+	kv_stat_hist(m, store, "write_ns", offsetof(struct kv_stats, write_ns));
+	return 0;
 }
 
 SYSCALL_DEFINE3(set_thread_socket_ctrl, pid_t, tid, int, limit, int, priority) {
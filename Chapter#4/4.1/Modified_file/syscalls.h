@@ -315,6 +315,28 @@ static inline void addr_limit_user_check(void)
  */
 asmlinkage long sys_write_kv(int k, int v);
 asmlinkage long sys_read_kv(int k);
+asmlinkage long sys_write_kv_batch(const int __user *keys, const int __user *vals,
+				   unsigned int n);
+asmlinkage long sys_read_kv_batch(const int __user *keys, int __user *vals,
+				  unsigned int n);
+asmlinkage long sys_kv_ctl(int op, unsigned long arg);
+asmlinkage long sys_kv_cas(int k, int expected, int new);
+asmlinkage long sys_kv_fetch_add(int k, int delta, int __user *old);
+asmlinkage long sys_kv_scan(unsigned long __user *cursor, int __user *keys,
+			    int __user *vals, unsigned int max);
+asmlinkage long sys_write_kv_ttl(int k, int v, unsigned int ms);
+asmlinkage long sys_kv_wait(int k, int expected, unsigned int timeout_ms);
+asmlinkage long sys_kv_attach(const char __user *name, int flags, umode_t mode);
+asmlinkage long sys_kv_ns_write(int fd, int k, int v);
+asmlinkage long sys_kv_ns_read(int fd, int k, int __user *v);
+asmlinkage long sys_kv_dump(int fd);
+asmlinkage long sys_kv_load(int fd);
+asmlinkage long sys_kv_range(long lo, long hi, int __user *keys,
+			     int __user *vals, unsigned int max);
+asmlinkage long sys_write_kv_blob(u64 k, const void __user *buf, unsigned int len);
+asmlinkage long sys_read_kv_blob(u64 k, void __user *buf, unsigned int len);
+asmlinkage long sys_kv_snapshot(int flags);
+asmlinkage long sys_kv_watch(int k, int efd);
 
 asmlinkage long sys_set_thread_socket_ctrl(pid_t tid, int limit, int priority);
 